@@ -14,10 +14,19 @@
 #include <process.h>
 #else
 #include <dlfcn.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #endif
 
 #include <time.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -26,8 +35,31 @@
 #include <sstream>
 #include <string>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <atomic>
 #include <stdexcept>
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_HW
+#define CRC32C_TARGET
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// Built for any x86: use the SSE4.2 crc32 instruction if the CPU has it.
+#include <nmmintrin.h>
+#define HAVE_CRC32C_HW
+#define CRC32C_DISPATCH
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
+#endif
+
 #include "vixDiskLib.h"
 
 using std::cout;
@@ -48,6 +80,16 @@ using std::vector;
 #define COMMAND_READBENCH       (1 << 10)
 #define COMMAND_WRITEBENCH      (1 << 11)
 #define COMMAND_CHECKREPAIR     (1 << 12)
+#define COMMAND_BENCHJOB        (1 << 13)
+#define COMMAND_COPY            (1 << 14)
+#define COMMAND_VERIFY          (1 << 15)
+#define COMMAND_DIGEST          (1 << 16)
+#define COMMAND_DIFF            (1 << 17)
+#define COMMAND_SEARCH          (1 << 18)
+#define COMMAND_PROFILE         (1 << 19)
+#define COMMAND_IMPORT_META     (1 << 20)
+#define COMMAND_EXPORT_META     (1 << 21)
+#define COMMAND_DIFF_META       (1 << 22)
 
 #define VIXDISKLIB_VERSION_MAJOR 6
 #define VIXDISKLIB_VERSION_MINOR 0
@@ -55,20 +97,102 @@ using std::vector;
 // Default buffer size (in sectors) for read/write benchmarks
 #define DEFAULT_BUFSIZE 128
 
+// Sectors read per request, and formatted per write to stdout, by -dump
+#define DUMP_BATCH_SECTORS 2048
+
+// Bytes per line of -dump output, and the most characters such a line
+// takes (offset of up to 16 digits, " : ", bytes, "  ", ASCII, newline)
+#define DUMP_BYTES_PER_LINE 16
+#define DUMP_LINE_MAX (16 + 3 + 4 * DUMP_BYTES_PER_LINE + 2 + 1)
+
 // Print updated statistics for read/write benchmarks roughly every
 // BUFS_PER_STAT sectors (current value is 64MBytes worth of data)
 #define BUFS_PER_STAT (128 * 1024)
 
+// Upper bound for the number of outstanding asynchronous requests (-qd)
+#define MAX_QUEUE_DEPTH 256
+
+// Default -pattern zipf exponent, the usual YCSB hot-set skew
+#define DEFAULT_ZIPF_THETA 0.99
+
+// Default -pattern stride distance, in buffers
+#define DEFAULT_STRIDE 16
+
+// A -sweep block size is the knee of the throughput curve when doubling
+// it gains less than this fraction of throughput
+#define SWEEP_KNEE_GAIN 0.10
+
+// Default and maximum chunk size (in MBytes) of copies (-chunk)
+#define DEFAULT_COPY_CHUNK_MB 1
+#define MAX_COPY_CHUNK_MB 16
+
+// Default and maximum number of chunk buffers of a copy pipeline (-depth)
+#define DEFAULT_PIPELINE_DEPTH 8
+#define MAX_PIPELINE_DEPTH 64
+
+// Maximum number of reader threads of -copy (-readers)
+#define MAX_COPY_READERS 16
+
+// Granularity (in sectors) at which the copy pipeline elides all-zero
+// data, one grain of a sparse destination
+#define ZERO_BLOCK_SECTORS 128
+
+// Default number of chunks in flight for -copy -extents (see -qd)
+#define DEFAULT_EXTENT_QD 8
+
+// Chunks the -fanout reader may run ahead of the slowest writer
+#define FANOUT_DEPTH 4
+
 // Character array for randonm filename generation
 static const char randChars[] = "0123456789"
    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
 
+// Contents written by -fill (-fillpattern): the -val byte, zeros, the
+// number of every sector, or random data from -seed.
+enum FillPattern {
+   FILL_BYTE,
+   FILL_ZERO,
+   FILL_LBA,
+   FILL_RANDOM,
+};
+
+// Access patterns for the read/write benchmarks (-pattern).
+enum BenchPattern {
+   PATTERN_SEQUENTIAL,
+   PATTERN_REVERSE,
+   PATTERN_STRIDED,
+   PATTERN_RANDOM,
+   PATTERN_ZIPF,
+};
+
+// Access pattern of a benchmark workload: stride is the distance (in
+// buffers) of PATTERN_STRIDED, zipfTheta the skew of PATTERN_ZIPF.
+struct PatternSpec {
+   BenchPattern kind;
+   uint64 stride;
+   double zipfTheta;
+};
+
+// Results of a copy: copiedSectors were read from the source, of
+// which zeroBlocks blocks (zeroSectors sectors) were all zeros and not
+// written; skippedSectors were not read at all as they are unallocated.
+struct CopyStats {
+   VixDiskLibSectorType copiedSectors;
+   VixDiskLibSectorType skippedSectors;
+   VixDiskLibSectorType zeroSectors;
+   uint64 zeroBlocks;
+   uint64 startNs;
+   uint64 endNs;
+};
+
 // Per-thread information for multi-threaded VixDiskLib test.
 struct ThreadData {
    std::string dstDisk;
    VixDiskLibHandle srcHandle;
    VixDiskLibHandle dstHandle;
    VixDiskLibSectorType numSectors;
+   std::vector<VixDiskLibBlock> extents;
+   CopyStats stats;
 };
 
 
@@ -102,8 +226,47 @@ static struct {
     char *libdir;
     char *ssMoRef;
     int repair;
+    unsigned qdMin;
+    unsigned qdMax;
+    Bool interleave;
+    Bool countSpecified;
+    PatternSpec pattern;
+    uint64 seed;
+    char *jobFile;
+    VixDiskLibSectorType sweepMin;
+    VixDiskLibSectorType sweepMax;
+    uint64 durationNs;
+    uint64 warmupNs;
+    Bool hugePages;
+    Bool lockBuffers;
+    Bool bufStats;
+    uint32 compressPct;
+    uint32 dedupPct;
+    uint32 chunkMB;
+    char *extentFile;
+    Bool extentBytes;
+    Bool fanout;
+    uint32 pipelineDepth;
+    uint32 numReaders;
+    Bool resume;
+    uint32 limitMBps;
+    uint32 limitIops;
+    char *rateSchedule;
+    char *checksumFile;
+    char *verifyFile;
+    char *digestFile;
+    char *diffPath;
+    char *rawFile;
+    FillPattern fillPattern;
+    char *profileFile;
+    Bool json;
+    char *metaFile;
+    char *diskList;
 } appGlobals;
 
+// Patterns of the -search command, as given.
+static vector<string> searchPatterns;
+
 static int ParseArguments(int argc, char* argv[]);
 static void DoCreate(void);
 static void DoRedo(void);
@@ -112,13 +275,24 @@ static void DoDump(void);
 static void DoReadMetadata(void);
 static void DoWriteMetadata(void);
 static void DoDumpMetadata(void);
+static void DoImportMetadata(void);
+static void DoExportMetadata(void);
+static void DoDiffMetadata(void);
 static void DoInfo(void);
 static void DoTestMultiThread(void);
 static void DoClone(void);
 static int BitCount(int number);
-static void DumpBytes(const uint8 *buf, size_t n, int step);
+static size_t DumpBytes(const uint8 *buf, size_t n, int step, char *out);
 static void DoRWBench(bool read);
 static void DoCheckRepair(Bool repair);
+static void DoBenchJobs(void);
+static void DoCopy(void);
+static void DoVerify(void);
+static void DoDigest(void);
+static void DoDiff(void);
+static void DoSearch(void);
+static void DoProfile(void);
+static bool ParsePattern(const char *spec, PatternSpec *pattern);
 
 
 #define THROW_ERROR(vixError) \
@@ -221,6 +395,38 @@ static VixError
                         VixDiskLibSectorType numSectors,
                         const uint8 *writeBuffer);
 
+static VixError
+(*VixDiskLib_ReadAsync_Ptr)(VixDiskLibHandle diskHandle,
+                            VixDiskLibSectorType startSector,
+                            VixDiskLibSectorType numSectors,
+                            uint8 *readBuffer,
+                            VixDiskLibCompletionCB callback,
+                            void *cbData);
+
+static VixError
+(*VixDiskLib_WriteAsync_Ptr)(VixDiskLibHandle diskHandle,
+                             VixDiskLibSectorType startSector,
+                             VixDiskLibSectorType numSectors,
+                             const uint8 *writeBuffer,
+                             VixDiskLibCompletionCB callback,
+                             void *cbData);
+
+static VixError
+(*VixDiskLib_Wait_Ptr)(VixDiskLibHandle diskHandle);
+
+static VixError
+(*VixDiskLib_Flush_Ptr)(VixDiskLibHandle diskHandle);
+
+static VixError
+(*VixDiskLib_QueryAllocatedBlocks_Ptr)(VixDiskLibHandle diskHandle,
+                                       VixDiskLibSectorType startSector,
+                                       VixDiskLibSectorType numSectors,
+                                       VixDiskLibSectorType chunkSize,
+                                       VixDiskLibBlockList **blockList);
+
+static VixError
+(*VixDiskLib_FreeBlockList_Ptr)(VixDiskLibBlockList *blockList);
+
 static VixError
 (*VixDiskLib_ReadMetadata_Ptr)(VixDiskLibHandle diskHandle,
                                const char *key,
@@ -402,6 +608,12 @@ DynLoadDiskLib(void)
       LOAD_ONE_FUNC(hInstLib, VixDiskLib_Close);
       LOAD_ONE_FUNC(hInstLib, VixDiskLib_Read);
       LOAD_ONE_FUNC(hInstLib, VixDiskLib_Write);
+      LOAD_ONE_FUNC(hInstLib, VixDiskLib_ReadAsync);
+      LOAD_ONE_FUNC(hInstLib, VixDiskLib_WriteAsync);
+      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Wait);
+      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Flush);
+      LOAD_ONE_FUNC(hInstLib, VixDiskLib_QueryAllocatedBlocks);
+      LOAD_ONE_FUNC(hInstLib, VixDiskLib_FreeBlockList);
       LOAD_ONE_FUNC(hInstLib, VixDiskLib_ReadMetadata);
       LOAD_ONE_FUNC(hInstLib, VixDiskLib_WriteMetadata);
       LOAD_ONE_FUNC(hInstLib, VixDiskLib_GetMetadataKeys);
@@ -440,6 +652,12 @@ DynLoadDiskLib(void)
 #define VixDiskLib_Close            (*VixDiskLib_Close_Ptr)
 #define VixDiskLib_Read             (*VixDiskLib_Read_Ptr)
 #define VixDiskLib_Write            (*VixDiskLib_Write_Ptr)
+#define VixDiskLib_ReadAsync        (*VixDiskLib_ReadAsync_Ptr)
+#define VixDiskLib_WriteAsync       (*VixDiskLib_WriteAsync_Ptr)
+#define VixDiskLib_Wait             (*VixDiskLib_Wait_Ptr)
+#define VixDiskLib_Flush            (*VixDiskLib_Flush_Ptr)
+#define VixDiskLib_QueryAllocatedBlocks (*VixDiskLib_QueryAllocatedBlocks_Ptr)
+#define VixDiskLib_FreeBlockList    (*VixDiskLib_FreeBlockList_Ptr)
 #define VixDiskLib_ReadMetadata     (*VixDiskLib_ReadMetadata_Ptr)
 #define VixDiskLib_WriteMetadata    (*VixDiskLib_WriteMetadata_Ptr)
 #define VixDiskLib_GetMetadataKeys  (*VixDiskLib_GetMetadataKeys_Ptr)
@@ -519,12 +737,50 @@ gettimeofday(struct timeval *tv,
 #endif
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetTimeNs --
+ *
+ *      Reads a monotonic clock, for timing individual I/O requests.
+ *
+ * Results:
+ *      Current time in nanoseconds from an arbitrary starting point.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint64
+GetTimeNs(void)
+{
+#ifdef _WIN32
+   static LARGE_INTEGER freq;
+   LARGE_INTEGER now;
+
+   if (freq.QuadPart == 0) {
+      QueryPerformanceFrequency(&freq);
+   }
+   QueryPerformanceCounter(&now);
+   return (uint64)((double)now.QuadPart * 1000000000.0 / freq.QuadPart);
+#else
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+
 /*
  *--------------------------------------------------------------------------
  *
  * LogFunc --
  *
- *      Callback for VixDiskLib Log messages.
+ *      Callback for VixDiskLib Log messages. With -json they go to
+ *      stderr, so that stdout holds only the JSON object.
  *
  * Results:
  *      None.
@@ -538,8 +794,10 @@ gettimeofday(struct timeval *tv,
 static void
 LogFunc(const char *fmt, va_list args)
 {
-   printf("Log: ");
-   vprintf(fmt, args);
+   FILE *out = appGlobals.json ? stderr : stdout;
+
+   fprintf(out, "Log: ");
+   vfprintf(out, fmt, args);
 }
 
 
@@ -548,7 +806,8 @@ LogFunc(const char *fmt, va_list args)
  *
  * WarnFunc --
  *
- *      Callback for VixDiskLib Warning messages.
+ *      Callback for VixDiskLib Warning messages. With -json they go to
+ *      stderr, like Log messages.
  *
  * Results:
  *      None.
@@ -562,8 +821,10 @@ LogFunc(const char *fmt, va_list args)
 static void
 WarnFunc(const char *fmt, va_list args)
 {
-   printf("Warning: ");
-   vprintf(fmt, args);
+   FILE *out = appGlobals.json ? stderr : stdout;
+
+   fprintf(out, "Warning: ");
+   vfprintf(out, fmt, args);
 }
 
 
@@ -636,13 +897,15 @@ class VixDisk
 public:
 
     VixDiskLibHandle Handle() { return _handle; }
-    VixDisk(VixDiskLibConnection connection, char *path, uint32 flags)
+    VixDisk(VixDiskLibConnection connection, const char *path, uint32 flags)
     {
        _handle = NULL;
        VixError vixError = VixDiskLib_Open(connection, path, flags, &_handle);
        CHECK_AND_THROW(vixError);
-       printf("Disk \"%s\" is open using transport mode \"%s\".\n",
-              path, VixDiskLib_GetTransportMode(_handle));
+       if (!appGlobals.json) {
+          printf("Disk \"%s\" is open using transport mode \"%s\".\n",
+                 path, VixDiskLib_GetTransportMode(_handle));
+       }
     }
 
     ~VixDisk()
@@ -658,248 +921,1235 @@ private:
 };
 
 
+// Thin wrappers around the native mutex and condition variable, used to
+// synchronize with VixDiskLib completion callbacks and worker threads.
+
+class Mutex
+{
+public:
+#ifdef _WIN32
+    Mutex() { InitializeCriticalSection(&_lock); }
+    ~Mutex() { DeleteCriticalSection(&_lock); }
+    void Lock() { EnterCriticalSection(&_lock); }
+    void Unlock() { LeaveCriticalSection(&_lock); }
+#else
+    Mutex() { pthread_mutex_init(&_lock, NULL); }
+    ~Mutex() { pthread_mutex_destroy(&_lock); }
+    void Lock() { pthread_mutex_lock(&_lock); }
+    void Unlock() { pthread_mutex_unlock(&_lock); }
+#endif
+
+private:
+    friend class CondVar;
+#ifdef _WIN32
+    CRITICAL_SECTION _lock;
+#else
+    pthread_mutex_t _lock;
+#endif
+};
+
+class CondVar
+{
+public:
+#ifdef _WIN32
+    CondVar() { InitializeConditionVariable(&_cond); }
+    ~CondVar() { }
+    void Wait(Mutex &mutex) { SleepConditionVariableCS(&_cond, &mutex._lock, INFINITE); }
+    void Signal() { WakeConditionVariable(&_cond); }
+    void Broadcast() { WakeAllConditionVariable(&_cond); }
+#else
+    CondVar() { pthread_cond_init(&_cond, NULL); }
+    ~CondVar() { pthread_cond_destroy(&_cond); }
+    void Wait(Mutex &mutex) { pthread_cond_wait(&_cond, &mutex._lock); }
+    void Signal() { pthread_cond_signal(&_cond); }
+    void Broadcast() { pthread_cond_broadcast(&_cond); }
+#endif
+
+private:
+#ifdef _WIN32
+    CONDITION_VARIABLE _cond;
+#else
+    pthread_cond_t _cond;
+#endif
+};
+
+
+// Portable worker thread entry point and return codes.
+
+#ifdef _WIN32
+#define TASK_OK 0
+#define TASK_FAIL 1
+#define TASK_CALL __stdcall
+
+typedef unsigned TaskResult;
+typedef HANDLE ThreadHandle;
+#else
+#define TASK_OK ((void*)0)
+#define TASK_FAIL ((void*)1)
+#define TASK_CALL
+
+typedef void *TaskResult;
+typedef pthread_t ThreadHandle;
+#endif
+
+typedef TaskResult (TASK_CALL *TaskFunc)(void *arg);
+
+
 /*
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  *
- * PrintUsage --
+ * StartThread --
  *
- *      Displays the usage message.
+ *      Starts a new thread running func(arg).
  *
  * Results:
- *      1.
+ *      Handle of the new thread, to be passed to JoinThread.
  *
  * Side effects:
  *      None.
  *
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  */
 
-static int
-PrintUsage(void)
+static ThreadHandle
+StartThread(TaskFunc func, // IN
+            void *arg)     // IN
 {
-    printf("Usage: vixdisklibsample.exe command [options] diskPath\n\n");
+#ifdef _WIN32
+   unsigned int threadId;
 
-    printf("List of commands (all commands are mutually exclusive):\n");
-    printf(" -create : creates a sparse virtual disk with capacity "
-           "specified by -cap\n");
-    printf(" -redo parentPath : creates a redo log 'diskPath' "
-           "for base disk 'parentPath'\n");
-    printf(" -info : displays information for specified virtual disk\n");
-    printf(" -dump : dumps the contents of specified range of sectors "
-           "in hexadecimal\n");
-    printf(" -fill : fills specified range of sectors with byte value "
-           "specified by -val\n");
-    printf(" -wmeta key value : writes (key,value) entry into disk's metadata table\n");
-    printf(" -rmeta key : displays the value of the specified metada entry\n");
-    printf(" -meta : dumps all entries of the disk's metadata\n");
-    printf(" -clone sourcePath : clone source vmdk possibly to a remote site\n");
-    printf(" -readbench blocksize: Does a read benchmark on a disk using the \n");
-    printf("specified I/O block size (in sectors).\n");
-    printf(" -writebench blocksize: Does a write benchmark on a disk using the\n");
-    printf("specified I/O block size (in sectors). WARNING: This will\n");
-    printf("overwrite the contents of the disk specified.\n");
-    printf(" -check repair: Check a sparse disk for internal consistency, "
-           "where repair is a boolean value to indicate if a repair operation "
-           "should be attempted.\n\n");
+   return (HANDLE)_beginthreadex(NULL, 0, func, arg, 0, &threadId);
+#else
+   pthread_t thread;
 
-    printf("options:\n");
-    printf(" -adapter [ide|scsi] : bus adapter type for 'create' option "
-           "(default='scsi')\n");
-    printf(" -start n : start sector for 'dump/fill' options (default=0)\n");
-    printf(" -count n : number of sectors for 'dump/fill' options (default=1)\n");
-    printf(" -val byte : byte value to fill with for 'write' option (default=255)\n");
-    printf(" -cap megabytes : capacity in MB for -create option (default=100)\n");
-    printf(" -single : open file as single disk link (default=open entire chain)\n");
-    printf(" -multithread n: start n threads and copy the file to n new files\n");
-    printf(" -host hostname : hostname/IP address of VC/vSphere host (Mandatory)\n");
-    printf(" -user userid : user name on host (Mandatory) \n");
-    printf(" -password password : password on host. (Mandatory)\n");
-    printf(" -port port : port to use to connect to host (default = 443) \n");
-    printf(" -vm moref=id : id is the managed object reference of the VM \n");
-    printf(" -libdir dir : Folder location of the VDDK installation. "
-           "On Windows, the bin folder holds the plugin.  On Linux, it is "
-           "the lib64 directory\n");
-    printf(" -initex configfile : Specify path and filename of config file \n");
-    printf(" -ssmoref moref : Managed object reference of VM snapshot \n");
-    printf(" -mode mode : Mode string to pass into VixDiskLib_ConnectEx. "
-	        "Valid modes are: nbd, nbdssl, san, hotadd \n");
-    printf(" -thumb string : Provides a SSL thumbprint string for validation. "
-           "Format: xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx\n");
-    
-    return 1;
+   pthread_create(&thread, NULL, func, arg);
+   return thread;
+#endif
 }
 
 
 /*
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  *
- * main --
+ * JoinThread --
  *
- *      Main routine of the program.
+ *      Waits for a thread started by StartThread to terminate.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      None.
+ *      Releases the thread handle.
  *
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  */
 
-int
-main(int argc, char* argv[])
+static void
+JoinThread(ThreadHandle thread) // IN
 {
-    int retval;
-    bool bVixInit(false);
+#ifdef _WIN32
+   WaitForSingleObject(thread, INFINITE);
+   CloseHandle(thread);
+#else
+   void *hlp;
 
-    memset(&appGlobals, 0, sizeof appGlobals);
-    appGlobals.command = 0;
-    appGlobals.adapterType = VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC;
-    appGlobals.startSector = 0;
-    appGlobals.numSectors = 1;
-    appGlobals.mbSize = 100;
-    appGlobals.filler = 0xff;
-    appGlobals.openFlags = 0;
-    appGlobals.numThreads = 1;
-    appGlobals.success = TRUE;
-    appGlobals.isRemote = FALSE;
+   pthread_join(thread, &hlp);
+#endif
+}
 
-    retval = ParseArguments(argc, argv);
-    if (retval) {
-        return retval;
-    }
 
-#ifdef DYNAMIC_LOADING
-    DynLoadDiskLib();
-#endif
+// Bounded lock-free multi-producer/multi-consumer ring (after Dmitry
+// Vyukov's queue): every cell carries a sequence number telling whether
+// it is ready to be filled or to be emptied at the current position.
+// Pop sleeps on a condition variable while the ring is empty; a push
+// only takes the lock when a consumer is asleep. Close wakes all
+// consumers for good once no more values will come.
 
-    // Initialize random generator
-    struct timeval time;
-    gettimeofday(&time, NULL);
+template <typename T>
+class BoundedRing
+{
+public:
+    // Smallest capacity holding n values.
+    static size_t CapacityFor(size_t n) // IN
+    {
+       size_t capacity = 2;
 
-    srand((time.tv_sec * 1000) + (time.tv_usec/1000));
+       while (capacity < n) {
+          capacity *= 2;
+       }
+       return capacity;
+    }
 
-    VixDiskLibConnectParams cnxParams = {0};
-    VixError vixError;
-    try {
-       if (appGlobals.isRemote) {
-          cnxParams.vmxSpec = appGlobals.vmxSpec;
-          cnxParams.serverName = appGlobals.host;
-          cnxParams.credType = VIXDISKLIB_CRED_UID;
-          cnxParams.creds.uid.userName = appGlobals.userName;
-          cnxParams.creds.uid.password = appGlobals.password;
-          cnxParams.thumbPrint = appGlobals.thumbPrint;
-          cnxParams.port = appGlobals.port;
+    explicit BoundedRing(size_t capacity) // IN: a power of two
+       : _cells(capacity),
+         _mask(capacity - 1),
+         _head(0),
+         _tail(0),
+         _sleepers(0),
+         _closed(false)
+    {
+       size_t i;
+
+       for (i = 0; i < capacity; i++) {
+          _cells[i].seq.store(i, std::memory_order_relaxed);
        }
+    }
 
-       if (appGlobals.useInitEx) {
-          vixError = VixDiskLib_InitEx(VIXDISKLIB_VERSION_MAJOR,
-                                       VIXDISKLIB_VERSION_MINOR,
-                                       &LogFunc, &WarnFunc, &PanicFunc,
-                                       appGlobals.libdir,
-                                       appGlobals.cfgFile);
-       } else {
-          vixError = VixDiskLib_Init(VIXDISKLIB_VERSION_MAJOR,
-                                     VIXDISKLIB_VERSION_MINOR,
-                                     NULL, NULL, NULL, // Log, warn, panic
-                                     appGlobals.libdir);
+    // Returns false if the ring is full.
+    bool TryPush(const T &value) // IN
+    {
+       size_t pos = _tail.load(std::memory_order_relaxed);
+       Cell *cell;
+
+       for (;;) {
+          cell = &_cells[pos & _mask];
+          size_t seq = cell->seq.load(std::memory_order_acquire);
+          intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+
+          if (dif == 0) {
+             if (_tail.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+                break;
+             }
+          } else if (dif < 0) {
+             return false;
+          } else {
+             pos = _tail.load(std::memory_order_relaxed);
+          }
        }
-       CHECK_AND_THROW(vixError);
-       bVixInit = true;
+       cell->value = value;
+       cell->seq.store(pos + 1, std::memory_order_release);
+
+       // Pairs with the fence in Pop: either the sleeper sees the value,
+       // or this sees the sleeper.
+       std::atomic_thread_fence(std::memory_order_seq_cst);
+       if (_sleepers.load(std::memory_order_relaxed) != 0) {
+          _lock.Lock();
+          _cond.Signal();
+          _lock.Unlock();
+       }
+       return true;
+    }
 
-       if (appGlobals.vmxSpec != NULL) {
-          vixError = VixDiskLib_PrepareForAccess(&cnxParams, "Sample");
-          CHECK_AND_THROW(vixError);
+    // Returns false if the ring is empty.
+    bool TryPop(T *value) // OUT
+    {
+       size_t pos = _head.load(std::memory_order_relaxed);
+       Cell *cell;
+
+       for (;;) {
+          cell = &_cells[pos & _mask];
+          size_t seq = cell->seq.load(std::memory_order_acquire);
+          intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+          if (dif == 0) {
+             if (_head.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+                break;
+             }
+          } else if (dif < 0) {
+             return false;
+          } else {
+             pos = _head.load(std::memory_order_relaxed);
+          }
        }
-       if (appGlobals.ssMoRef == NULL && appGlobals.transportModes == NULL) {
-          vixError = VixDiskLib_Connect(&cnxParams,
-                                        &appGlobals.connection);
-       } else {
-          Bool ro = (appGlobals.openFlags & VIXDISKLIB_FLAG_OPEN_READ_ONLY);
-          vixError = VixDiskLib_ConnectEx(&cnxParams, ro, appGlobals.ssMoRef,
-                                          appGlobals.transportModes,
-                                          &appGlobals.connection);
+       *value = cell->value;
+       cell->seq.store(pos + _mask + 1, std::memory_order_release);
+       return true;
+    }
+
+    // Pops a value, sleeping while the ring is empty. Returns false once
+    // the ring is closed and empty.
+    bool Pop(T *value) // OUT
+    {
+       bool popped;
+
+       if (TryPop(value)) {
+          return true;
        }
-       CHECK_AND_THROW(vixError);
-        if (appGlobals.command & COMMAND_INFO) {
-            DoInfo();
-        } else if (appGlobals.command & COMMAND_CREATE) {
-            DoCreate();
-        } else if (appGlobals.command & COMMAND_REDO) {
-            DoRedo();
-        } else if (appGlobals.command & COMMAND_FILL) {
-            DoFill();
-        } else if (appGlobals.command & COMMAND_DUMP) {
-            DoDump();
-        } else if (appGlobals.command & COMMAND_READ_META) {
-            DoReadMetadata();
-        } else if (appGlobals.command & COMMAND_WRITE_META) {
-            DoWriteMetadata();
-        } else if (appGlobals.command & COMMAND_DUMP_META) {
-            DoDumpMetadata();
-        } else if (appGlobals.command & COMMAND_MULTITHREAD) {
-            DoTestMultiThread();
-        } else if (appGlobals.command & COMMAND_CLONE) {
-            DoClone();
-        } else if (appGlobals.command & COMMAND_READBENCH) {
-            DoRWBench(true);
-        } else if (appGlobals.command & COMMAND_WRITEBENCH) {
-            DoRWBench(false);
-        } else if (appGlobals.command & COMMAND_CHECKREPAIR) {
-            DoCheckRepair(appGlobals.repair);
-        }
-        retval = 0;
-    } catch (const VixDiskLibErrWrapper& e) {
-       cout << "Error: [" << e.File() << ":" << e.Line() << "]  " <<
-               std::hex << e.ErrorCode() << " " << e.Description() << "\n";
-       retval = 1;
+       _lock.Lock();
+       _sleepers.fetch_add(1);
+       for (;;) {
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+          popped = TryPop(value);
+          if (popped || _closed.load()) {
+             break;
+          }
+          _cond.Wait(_lock);
+       }
+       _sleepers.fetch_sub(1);
+       _lock.Unlock();
+       return popped || TryPop(value);
     }
 
-    if (appGlobals.vmxSpec != NULL) {
-       vixError = VixDiskLib_EndAccess(&cnxParams, "Sample");
+    // Wakes up all consumers; Pop no longer sleeps.
+    void Close()
+    {
+       _lock.Lock();
+       _closed.store(true);
+       _cond.Broadcast();
+       _lock.Unlock();
     }
-    if (appGlobals.connection != NULL) {
-       VixDiskLib_Disconnect(appGlobals.connection);
+
+private:
+    struct Cell {
+       std::atomic<size_t> seq;
+       T value;
+    };
+
+    vector<Cell> _cells;
+    size_t _mask;
+    char _pad0[64];
+    std::atomic<size_t> _head;
+    char _pad1[64];
+    std::atomic<size_t> _tail;
+    std::atomic<uint32> _sleepers;
+    std::atomic<bool> _closed;
+    Mutex _lock;
+    CondVar _cond;
+};
+
+// One chunk buffer on its way through the BoundedRings of a CopyPipeline
+// or of -fill.
+struct PipelineChunk {
+   VixDiskLibSectorType sector;
+   VixDiskLibSectorType numSectors;
+   uint8 *buf;
+};
+
+
+// Page-aligned I/O buffers shared by all read/write paths. Buffers are
+// rounded up to a power-of-two size class and returned to a per-class
+// free list on release, so steady-state I/O does not allocate. Callers
+// that start several threads Reserve their buffers first, so each size
+// class is carved out of one chunk. With -hugepages, chunks are made of
+// 2 MB huge pages; with -lockbufs, chunks are pinned in memory.
+
+#define POOL_PAGE_SIZE 4096
+#define POOL_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define POOL_NUM_CLASSES 24
+
+class BufferPool
+{
+public:
+    BufferPool()
+       : _gets(0),
+         _reuses(0),
+         _chunks(0),
+         _hugeChunks(0),
+         _reservedBytes(0),
+         _lockedBytes(0),
+         _lockFailures(0),
+         _inUseBytes(0),
+         _peakBytes(0)
+    {
     }
-    if (bVixInit) {
-       VixDiskLib_Exit();
+
+    ~BufferPool()
+    {
+       size_t i;
+
+       for (i = 0; i < _chunkList.size(); i++) {
+          FreeChunk(_chunkList[i].first, _chunkList[i].second);
+       }
     }
-    return retval;
+
+    // Returns a page-aligned buffer of at least size bytes.
+    uint8 *Get(size_t size) // IN
+    {
+       unsigned cls = SizeClass(size);
+       size_t classSize = (size_t)POOL_PAGE_SIZE << cls;
+       uint8 *buf;
+
+       _lock.Lock();
+       _gets++;
+       if (_freeLists[cls].empty()) {
+          try {
+             Refill(cls, 1);
+          } catch (...) {
+             _lock.Unlock();
+             throw;
+          }
+       } else {
+          _reuses++;
+       }
+       buf = _freeLists[cls].back();
+       _freeLists[cls].pop_back();
+       _inUseBytes += classSize;
+       _peakBytes = std::max(_peakBytes, _inUseBytes);
+       _lock.Unlock();
+       return buf;
+    }
+
+    // Returns a buffer obtained from Get(size) to the pool.
+    void Put(uint8 *buf,    // IN
+             size_t size)   // IN
+    {
+       unsigned cls = SizeClass(size);
+
+       _lock.Lock();
+       _freeLists[cls].push_back(buf);
+       _inUseBytes -= (size_t)POOL_PAGE_SIZE << cls;
+       _lock.Unlock();
+    }
+
+    // Makes sure that a Get of each of sizes, all at once, is served
+    // from the free lists, allocating at most one chunk per size class.
+    void Reserve(const vector<size_t> &sizes) // IN
+    {
+       size_t needed[POOL_NUM_CLASSES] = { 0 };
+       unsigned cls;
+       size_t i;
+
+       for (i = 0; i < sizes.size(); i++) {
+          needed[SizeClass(sizes[i])]++;
+       }
+       _lock.Lock();
+       try {
+          for (cls = 0; cls < POOL_NUM_CLASSES; cls++) {
+             if (needed[cls] > _freeLists[cls].size()) {
+                Refill(cls, needed[cls] - _freeLists[cls].size());
+             }
+          }
+       } catch (...) {
+          _lock.Unlock();
+          throw;
+       }
+       _lock.Unlock();
+    }
+
+    void PrintStats()
+    {
+       _lock.Lock();
+       printf("Buffer pool: %" FMT64 "u requests, %" FMT64 "u reused, "
+              "%" FMT64 "u chunks (%" FMT64 "u huge page), %" FMT64 "u KBytes "
+              "reserved, %" FMT64 "u KBytes peak in use, %" FMT64 "u KBytes "
+              "locked, %" FMT64 "u lock failures\n",
+              _gets, _reuses, _chunks, _hugeChunks, _reservedBytes / 1024,
+              _peakBytes / 1024, _lockedBytes / 1024, _lockFailures);
+       _lock.Unlock();
+    }
+
+private:
+    static unsigned SizeClass(size_t size)
+    {
+       unsigned cls = 0;
+
+       while (((size_t)POOL_PAGE_SIZE << cls) < size) {
+          cls++;
+       }
+       if (cls >= POOL_NUM_CLASSES) {
+          THROW_ERROR(VIX_E_OUT_OF_MEMORY);
+       }
+       return cls;
+    }
+
+    // Allocates a chunk for count buffers of size class cls and splits
+    // it into buffers. Called with _lock held.
+    void Refill(unsigned cls,    // IN
+                size_t count)    // IN
+    {
+       size_t classSize = (size_t)POOL_PAGE_SIZE << cls;
+       size_t chunkSize = classSize * count;
+       bool huge = false;
+       uint8 *chunk = NULL;
+       size_t off;
+
+       if (appGlobals.hugePages) {
+          chunkSize = (classSize * count + POOL_HUGE_PAGE_SIZE - 1) &
+                      ~(size_t)(POOL_HUGE_PAGE_SIZE - 1);
+          chunk = AllocChunk(chunkSize, true);
+          huge = chunk != NULL;
+       }
+       if (chunk == NULL) {
+          chunkSize = classSize * count;
+          chunk = AllocChunk(chunkSize, false);
+       }
+       if (chunk == NULL) {
+          THROW_ERROR(VIX_E_OUT_OF_MEMORY);
+       }
+       if (appGlobals.lockBuffers) {
+          if (LockChunk(chunk, chunkSize)) {
+             _lockedBytes += chunkSize;
+          } else {
+             _lockFailures++;
+          }
+       }
+       _chunkList.push_back(std::make_pair(chunk, chunkSize));
+       _chunks++;
+       _hugeChunks += huge ? 1 : 0;
+       _reservedBytes += chunkSize;
+       for (off = 0; off + classSize <= chunkSize; off += classSize) {
+          _freeLists[cls].push_back(chunk + off);
+       }
+    }
+
+    static uint8 *AllocChunk(size_t size,  // IN
+                             bool huge)    // IN
+    {
+#ifdef _WIN32
+       DWORD flags = MEM_COMMIT | MEM_RESERVE;
+
+       if (huge) {
+          SIZE_T largePage = GetLargePageMinimum();
+
+          if (largePage == 0 || size % largePage != 0) {
+             return NULL;
+          }
+          flags |= MEM_LARGE_PAGES;
+       }
+       return (uint8 *)VirtualAlloc(NULL, size, flags, PAGE_READWRITE);
+#else
+       int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+       void *p;
+
+       if (huge) {
+#ifdef MAP_HUGETLB
+          p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB,
+                   -1, 0);
+          if (p != MAP_FAILED) {
+             return (uint8 *)p;
+          }
+#endif
+#ifdef MADV_HUGEPAGE
+          /*
+           * No reserved huge pages: ask for transparent huge pages. The
+           * kernel only backs 2 MB aligned ranges with them, so map one
+           * huge page more and trim the region to an aligned one.
+           */
+          p = mmap(NULL, size + POOL_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                   flags, -1, 0);
+          if (p != MAP_FAILED) {
+             uint8 *start = (uint8 *)p;
+             uint8 *aligned = (uint8 *)(((size_t)start +
+                                         POOL_HUGE_PAGE_SIZE - 1) &
+                                        ~(size_t)(POOL_HUGE_PAGE_SIZE - 1));
+
+             if (aligned != start) {
+                munmap(start, aligned - start);
+             }
+             munmap(aligned + size, POOL_HUGE_PAGE_SIZE - (aligned - start));
+             madvise(aligned, size, MADV_HUGEPAGE);
+             return aligned;
+          }
+#endif
+          return NULL;
+       }
+       p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+       return p == MAP_FAILED ? NULL : (uint8 *)p;
+#endif
+    }
+
+    static void FreeChunk(uint8 *chunk,  // IN
+                          size_t size)   // IN
+    {
+#ifdef _WIN32
+       VirtualFree(chunk, 0, MEM_RELEASE);
+#else
+       munmap(chunk, size);
+#endif
+    }
+
+    static bool LockChunk(uint8 *chunk,  // IN
+                          size_t size)   // IN
+    {
+#ifdef _WIN32
+       return VirtualLock(chunk, size) != 0;
+#else
+       return mlock(chunk, size) == 0;
+#endif
+    }
+
+    Mutex _lock;
+    vector<uint8 *> _freeLists[POOL_NUM_CLASSES];
+    vector<std::pair<uint8 *, size_t> > _chunkList;
+    uint64 _gets;
+    uint64 _reuses;
+    uint64 _chunks;
+    uint64 _hugeChunks;
+    uint64 _reservedBytes;
+    uint64 _lockedBytes;
+    uint64 _lockFailures;
+    uint64 _inUseBytes;
+    uint64 _peakBytes;
+};
+
+static BufferPool bufferPool;
+
+
+// Scoped buffer from bufferPool.
+
+class IoBuffer
+{
+public:
+    explicit IoBuffer(size_t size)
+       : _buf(bufferPool.Get(size)),
+         _size(size)
+    {
+    }
+
+    ~IoBuffer() { bufferPool.Put(_buf, _size); }
+
+    uint8 *Get() { return _buf; }
+
+private:
+    IoBuffer(const IoBuffer &);
+    IoBuffer &operator=(const IoBuffer &);
+
+    uint8 *_buf;
+    size_t _size;
+};
+
+
+// Global limit on the bandwidth and request rate of all disk I/O, set by
+// -mbps, -iops and -ratesched. Each limit is a token bucket kept as the
+// time at which the bucket will be full again (GCRA): a request adds its
+// cost to that time with a CAS and sleeps until the result is within
+// RATE_BURST_NS of now. Threads are so served in arrival order with no
+// lock, and Acquire is a single test while no limit is set.
+// A schedule file has "HH:MM mbps iops" lines, each giving the limits
+// from that local time of day until the next line (0 is unlimited); it
+// is consulted once per RATE_SCHEDULE_CHECK_NS.
+
+#define RATE_BURST_NS           (50 * 1000000ULL)
+#define RATE_SCHEDULE_CHECK_NS  (1000000000ULL)
+
+class RateLimiter
+{
+public:
+    RateLimiter()
+       : _enabled(false),
+         _bytesPerSec(0),
+         _opsPerSec(0),
+         _bytesTat(0),
+         _opsTat(0),
+         _nextCheckNs(0),
+         _throttledNs(0)
+    {
+    }
+
+    void SetLimits(uint64 bytesPerSec, // IN: 0 for no limit
+                   uint64 opsPerSec)   // IN: 0 for no limit
+    {
+       _bytesPerSec.store(bytesPerSec);
+       _opsPerSec.store(opsPerSec);
+       _enabled = _enabled || bytesPerSec != 0 || opsPerSec != 0;
+    }
+
+    bool LoadSchedule(const char *path); // IN
+
+    // Waits until numSectors more sectors may be transferred.
+    void Acquire(VixDiskLibSectorType numSectors) // IN
+    {
+       if (_enabled) {
+          Throttle(numSectors);
+       }
+    }
+
+    uint64 ThrottledNs() const { return _throttledNs.load(); }
+
+private:
+    struct ScheduleEntry {
+       uint32 minute;
+       uint64 bytesPerSec;
+       uint64 opsPerSec;
+
+       bool operator<(const ScheduleEntry &other) const
+       {
+          return minute < other.minute;
+       }
+    };
+
+    void Throttle(VixDiskLibSectorType numSectors); // IN
+    void ApplySchedule(void);
+
+    static uint64 Reserve(std::atomic<uint64> &tat, // IN/OUT
+                          uint64 rate,              // IN
+                          uint64 amount,            // IN
+                          uint64 now);              // IN
+
+    bool _enabled;
+    vector<ScheduleEntry> _schedule;
+    std::atomic<uint64> _bytesPerSec;
+    std::atomic<uint64> _opsPerSec;
+    std::atomic<uint64> _bytesTat;
+    std::atomic<uint64> _opsTat;
+    std::atomic<uint64> _nextCheckNs;
+    std::atomic<uint64> _throttledNs;
+};
+
+static RateLimiter rateLimiter;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RateLimiter::LoadSchedule --
+ *
+ *      Reads a schedule of limits, and applies the one for the current
+ *      time of day.
+ *
+ * Results:
+ *      false if the file cannot be read or has an invalid line.
+ *
+ * Side effects:
+ *      Enables the limiter.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+RateLimiter::LoadSchedule(const char *path) // IN
+{
+   FILE *file = fopen(path, "r");
+   char line[256];
+   unsigned lineNo = 0;
+
+   if (file == NULL) {
+      printf("Error: Cannot open rate schedule %s.\n", path);
+      return false;
+   }
+   while (fgets(line, sizeof line, file) != NULL) {
+      ScheduleEntry entry;
+      unsigned hours, minutes;
+      unsigned long mbps, iops;
+      char *p = line;
+
+      lineNo++;
+      while (isspace((unsigned char)*p)) {
+         p++;
+      }
+      if (*p == '\0' || *p == '#') {
+         continue;
+      }
+      if (sscanf(p, "%u:%u %lu %lu", &hours, &minutes, &mbps, &iops) != 4 ||
+          hours > 23 || minutes > 59) {
+         printf("Error: %s:%d: expected 'HH:MM mbps iops'.\n", path, lineNo);
+         fclose(file);
+         return false;
+      }
+      entry.minute = hours * 60 + minutes;
+      entry.bytesPerSec = (uint64)mbps * 1024 * 1024;
+      entry.opsPerSec = iops;
+      _schedule.push_back(entry);
+   }
+   fclose(file);
+   if (_schedule.empty()) {
+      printf("Error: Rate schedule %s is empty.\n", path);
+      return false;
+   }
+   std::sort(_schedule.begin(), _schedule.end());
+   _enabled = true;
+   ApplySchedule();
+   return true;
 }
 
 
 /*
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  *
- * ParseArguments --
+ * RateLimiter::ApplySchedule --
  *
- *      Parses the arguments passed on the command line.
+ *      Sets the limits of the schedule entry covering the current local
+ *      time; before the first entry of the day, the last one applies.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Changes the limits.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RateLimiter::ApplySchedule(void)
+{
+   time_t now = time(NULL);
+   struct tm local;
+   uint32 minute;
+   size_t i = _schedule.size() - 1;
+
+#ifdef _WIN32
+   localtime_s(&local, &now);
+#else
+   localtime_r(&now, &local);
+#endif
+   minute = local.tm_hour * 60 + local.tm_min;
+   while (i > 0 && _schedule[i].minute > minute) {
+      i--;
+   }
+   if (_schedule[i].minute > minute) {
+      i = _schedule.size() - 1;
+   }
+   _bytesPerSec.store(_schedule[i].bytesPerSec);
+   _opsPerSec.store(_schedule[i].opsPerSec);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RateLimiter::Reserve --
+ *
+ *      Takes amount tokens from a bucket refilled at rate per second.
+ *
+ * Results:
+ *      Nanoseconds to wait before the tokens are available.
+ *
+ * Side effects:
+ *      Advances the bucket's time.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint64
+RateLimiter::Reserve(std::atomic<uint64> &tat, // IN/OUT
+                     uint64 rate,              // IN
+                     uint64 amount,            // IN
+                     uint64 now)               // IN
+{
+   uint64 cost, old, next;
+
+   if (rate == 0) {
+      return 0;
+   }
+   cost = (uint64)((double)amount * 1e9 / rate);
+   old = tat.load(std::memory_order_relaxed);
+   do {
+      next = std::max(old, now) + cost;
+   } while (!tat.compare_exchange_weak(old, next, std::memory_order_relaxed));
+   return next > now + RATE_BURST_NS ? next - now - RATE_BURST_NS : 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RateLimiter::Throttle --
+ *
+ *      Reserves the bandwidth and the request of a transfer, and sleeps
+ *      until both are available.
  *
  * Results:
  *      None.
  *
  * Side effects:
+ *      May apply the schedule, and sleep.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+RateLimiter::Throttle(VixDiskLibSectorType numSectors) // IN
+{
+   uint64 now = GetTimeNs();
+   uint64 check = _nextCheckNs.load(std::memory_order_relaxed);
+   uint64 wait;
+
+   if (!_schedule.empty() && now >= check &&
+       _nextCheckNs.compare_exchange_strong(check,
+                                            now + RATE_SCHEDULE_CHECK_NS)) {
+      ApplySchedule();
+   }
+   wait = std::max(Reserve(_bytesTat, _bytesPerSec.load(),
+                           numSectors * VIXDISKLIB_SECTOR_SIZE, now),
+                   Reserve(_opsTat, _opsPerSec.load(), 1, now));
+   if (wait == 0) {
+      return;
+   }
+   _throttledNs.fetch_add(wait, std::memory_order_relaxed);
+#ifdef _WIN32
+   Sleep((DWORD)((wait + 999999) / 1000000));
+#else
+   struct timespec ts;
+
+   ts.tv_sec = wait / 1000000000;
+   ts.tv_nsec = wait % 1000000000;
+   while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+   }
+#endif
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * PrintUsage --
+ *
+ *      Displays the usage message.
+ *
+ * Results:
+ *      1.
+ *
+ * Side effects:
  *      None.
  *
  *--------------------------------------------------------------------------
  */
 
 static int
-ParseArguments(int argc, char* argv[])
+PrintUsage(void)
 {
-    int i;
-    if (argc < 3) {
-        printf("Error: Too few arguments. See usage below.\n\n");
-        return PrintUsage();
-    }
-    for (i = 1; i < argc - 1; i++) {
-        if (!strcmp(argv[i], "-info")) {
-            appGlobals.command |= COMMAND_INFO;
-            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
-        } else if (!strcmp(argv[i], "-create")) {
-            appGlobals.command |= COMMAND_CREATE;
-        } else if (!strcmp(argv[i], "-dump")) {
-            appGlobals.command |= COMMAND_DUMP;
+    printf("Usage: vixdisklibsample.exe command [options] diskPath\n\n");
+
+    printf("List of commands (all commands are mutually exclusive):\n");
+    printf(" -create : creates a sparse virtual disk with capacity "
+           "specified by -cap\n");
+    printf(" -redo parentPath : creates a redo log 'diskPath' "
+           "for base disk 'parentPath'\n");
+    printf(" -info : displays information for specified virtual disk\n");
+    printf(" -dump : dumps the contents of specified range of sectors "
+           "in hexadecimal\n");
+    printf(" -fill : fills specified range of sectors with byte value "
+           "specified by -val, or with the -fillpattern data\n");
+    printf(" -wmeta key value : writes (key,value) entry into disk's metadata table\n");
+    printf(" -rmeta key : displays the value of the specified metada entry\n");
+    printf(" -meta : dumps all entries of the disk's metadata\n");
+    printf(" -metaimport file : writes every key=value line of file into "
+           "the metadata of diskPath and the -disklist disks; lines after "
+           "a [path] line apply to that disk only; a backslash escapes "
+           "the next character, \\n and \\r stand for line breaks\n");
+    printf(" -metaexport file : saves the metadata of diskPath and the "
+           "-disklist disks to file in the -metaimport format\n");
+    printf(" -metadiff : prints the metadata entries of every -disklist "
+           "disk that differ from those of diskPath\n");
+    printf(" -clone sourcePath : clone source vmdk possibly to a remote site\n");
+    printf(" -copy sourcePath : clone source vmdk with the copy pipeline, "
+           "skipping unallocated and zero blocks\n");
+    printf(" -verify manifest : re-reads the chunks listed in a -checksum "
+           "manifest and reports the extents that do not match\n");
+    printf(" -search pattern : prints the byte offset of every match of "
+           "pattern (text, or bytes as hex:0a1b...) on the disk; may be "
+           "repeated to search for several patterns at once\n");
+    printf(" -profile file : writes the allocation, zero block share and "
+           "byte entropy of every -chunk sized region of the disk to file "
+           "as CSV, and prints totals with compression and dedup "
+           "estimates\n");
+    printf(" -digest file : saves the hash tree of the disk's -chunk sized "
+           "chunks to file\n");
+    printf(" -diff path : compares the disk with another vmdk, either one "
+           "possibly given as a -digest file, and prints the extents that "
+           "differ\n");
+    printf(" -readbench blocksize: Does a read benchmark on a disk using the \n");
+    printf("specified I/O block size (in sectors).\n");
+    printf(" -writebench blocksize: Does a write benchmark on a disk using the\n");
+    printf("specified I/O block size (in sectors). WARNING: This will\n");
+    printf("overwrite the contents of the disk specified.\n");
+    printf(" -check repair: Check a sparse disk for internal consistency, "
+           "where repair is a boolean value to indicate if a repair operation "
+           "should be attempted.\n");
+    printf(" -job file : runs the read/write workloads described in file "
+           "concurrently. Each workload is a [name] section with disk, mix "
+           "(percent reads), compress, dedup, bs (size[:weight],...), "
+           "pattern, seed, qd, duration and warmup (seconds), start and "
+           "count settings. WARNING: workloads with writes overwrite the "
+           "contents of their disk.\n\n");
+
+    printf("options:\n");
+    printf(" -adapter [ide|scsi] : bus adapter type for 'create' option "
+           "(default='scsi')\n");
+    printf(" -start n : start sector for 'dump/fill' options and "
+           "benchmarks (default=0)\n");
+    printf(" -count n : number of sectors for 'dump/fill' options "
+           "(default=1) and benchmarks (default=rest of the disk)\n");
+    printf(" -val byte : byte value to fill with for 'write' option (default=255)\n");
+    printf(" -fillpattern [byte|zero|lba|random] : data written by -fill: "
+           "the -val byte, zeros, the sector number in every 8 bytes, or "
+           "random data from -seed (default=byte)\n");
+    printf(" -disklist file : with -metaimport, -metaexport or -metadiff, "
+           "also process the disks listed in file, one path per line, over "
+           "the same connection\n");
+    printf(" -json : print -meta and -rmeta output as a JSON object, "
+           "without the disk open message\n");
+    printf(" -raw file : with -dump, write the sectors to file as binary "
+           "instead of in hexadecimal\n");
+    printf(" -cap megabytes : capacity in MB for -create option (default=100)\n");
+    printf(" -single : open file as single disk link (default=open entire chain)\n");
+    printf(" -multithread n: start n threads and copy the file to n new files\n");
+    printf(" -extents file : with -copy, copy only the extents listed in "
+           "file (one 'offset length' pair per line) into the existing "
+           "destination, -qd chunks at a time (default=%d); with -diff, "
+           "save the differing extents to file\n",
+           DEFAULT_EXTENT_QD);
+    printf(" -extentunit [sectors|bytes] : unit of the -extents offsets "
+           "and lengths (default=sectors); QueryChangedDiskAreas returns "
+           "bytes\n");
+    printf(" -depth n : chunk buffers shared by the reader and writer "
+           "threads of -multithread and -copy, 2-%d (default=%d)\n",
+           MAX_PIPELINE_DEPTH, DEFAULT_PIPELINE_DEPTH);
+    printf(" -readers n : reader threads of -copy, -verify, -digest, -diff, "
+           "-search and -profile, each with its own disk handle, 1-%d "
+           "(default=1)\n", MAX_COPY_READERS);
+    printf(" -checksum file : with -copy, save the CRC32C of every copied "
+           "chunk to file, for -verify\n");
+    printf(" -resume : with -copy, complete the destination of a failed "
+           "copy, skipping the chunks recorded in its .ckpt file\n");
+    printf(" -fanout : with -multithread, read the source once and write "
+           "every chunk to all n new files\n");
+    printf(" -chunk mb : size of the chunks copied by -multithread and "
+           "-copy, hashed by -digest and -diff, read by -search and "
+           "profiled by -profile, 1-%d MBytes (default=%d)\n",
+           MAX_COPY_CHUNK_MB, DEFAULT_COPY_CHUNK_MB);
+    printf(" -mbps n : limit the disk I/O of all threads to n MBytes/sec "
+           "(default=unlimited)\n");
+    printf(" -iops n : limit the disk I/O of all threads to n requests/sec "
+           "(default=unlimited)\n");
+    printf(" -ratesched file : take the -mbps and -iops limits from file, "
+           "one 'HH:MM mbps iops' line per local time of day they start "
+           "at (0=unlimited)\n");
+    printf(" -host hostname : hostname/IP address of VC/vSphere host (Mandatory)\n");
+    printf(" -user userid : user name on host (Mandatory) \n");
+    printf(" -password password : password on host. (Mandatory)\n");
+    printf(" -port port : port to use to connect to host (default = 443) \n");
+    printf(" -vm moref=id : id is the managed object reference of the VM \n");
+    printf(" -libdir dir : Folder location of the VDDK installation. "
+           "On Windows, the bin folder holds the plugin.  On Linux, it is "
+           "the lib64 directory\n");
+    printf(" -initex configfile : Specify path and filename of config file \n");
+    printf(" -ssmoref moref : Managed object reference of VM snapshot \n");
+    printf(" -mode mode : Mode string to pass into VixDiskLib_ConnectEx. "
+	        "Valid modes are: nbd, nbdssl, san, hotadd \n");
+    printf(" -thumb string : Provides a SSL thumbprint string for validation. "
+           "Format: xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx\n");
+    printf(" -threads n : run -readbench/-writebench on n threads, each with "
+           "its own disk handle and a contiguous stripe of the disk; "
+           "generate -fill data on n threads\n");
+    printf(" -interleave : with -threads, interleave the threads buffer by "
+           "buffer instead of splitting the disk into stripes\n");
+    printf(" -compress pct : make benchmark writes pct%% compressible "
+           "(default=0: every block holds unique random data)\n");
+    printf(" -dedup pct : make pct%% of the benchmark write blocks "
+           "duplicates of earlier blocks (default=0)\n");
+    printf(" -hugepages : back I/O buffers with 2 MB huge pages when "
+           "available\n");
+    printf(" -lockbufs : lock I/O buffers in memory\n");
+    printf(" -bufstats : print I/O buffer allocation statistics on exit\n");
+    printf(" -duration secs : run -readbench/-writebench and -job workloads "
+           "for secs seconds, wrapping around the region, instead of one "
+           "pass over it\n");
+    printf(" -warmup secs : run -readbench/-writebench and -job workloads "
+           "for secs seconds before measuring; warm-up requests are not "
+           "reported\n");
+    printf(" -sweep n..m : run -readbench/-writebench once per power-of-two "
+           "block size from n to m sectors over the same region and report "
+           "the knee of the throughput curve\n");
+    printf(" -pattern p : access pattern for -readbench/-writebench: seq "
+           "(default), reverse, stride[:n] (every n-th buffer, default %d), "
+           "random or zipf[:theta] (hot set, default theta %.2f)\n",
+           DEFAULT_STRIDE, DEFAULT_ZIPF_THETA);
+    printf(" -seed n : seed for the random and zipf patterns (default=1)\n");
+    printf(" -qd n[..m] : keep n outstanding asynchronous requests during "
+           "-readbench/-writebench (1-%d); with a range, run once per "
+           "power-of-two queue depth from n to m\n", MAX_QUEUE_DEPTH);
+    
+    return 1;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * main --
+ *
+ *      Main routine of the program.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+main(int argc, char* argv[])
+{
+    int retval;
+    bool bVixInit(false);
+
+    memset(&appGlobals, 0, sizeof appGlobals);
+    appGlobals.command = 0;
+    appGlobals.adapterType = VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC;
+    appGlobals.startSector = 0;
+    appGlobals.numSectors = 1;
+    appGlobals.mbSize = 100;
+    appGlobals.filler = 0xff;
+    appGlobals.openFlags = 0;
+    appGlobals.numThreads = 1;
+    appGlobals.chunkMB = DEFAULT_COPY_CHUNK_MB;
+    appGlobals.pipelineDepth = DEFAULT_PIPELINE_DEPTH;
+    appGlobals.numReaders = 1;
+    appGlobals.success = TRUE;
+    appGlobals.isRemote = FALSE;
+    appGlobals.pattern.kind = PATTERN_SEQUENTIAL;
+    appGlobals.pattern.zipfTheta = DEFAULT_ZIPF_THETA;
+    appGlobals.seed = 1;
+
+    retval = ParseArguments(argc, argv);
+    if (retval) {
+        return retval;
+    }
+
+#ifdef DYNAMIC_LOADING
+    DynLoadDiskLib();
+#endif
+
+    // Initialize random generator
+    struct timeval time;
+    gettimeofday(&time, NULL);
+
+    srand((time.tv_sec * 1000) + (time.tv_usec/1000));
+
+    VixDiskLibConnectParams cnxParams = {0};
+    VixError vixError;
+    try {
+       if (appGlobals.isRemote) {
+          cnxParams.vmxSpec = appGlobals.vmxSpec;
+          cnxParams.serverName = appGlobals.host;
+          cnxParams.credType = VIXDISKLIB_CRED_UID;
+          cnxParams.creds.uid.userName = appGlobals.userName;
+          cnxParams.creds.uid.password = appGlobals.password;
+          cnxParams.thumbPrint = appGlobals.thumbPrint;
+          cnxParams.port = appGlobals.port;
+       }
+
+       if (appGlobals.useInitEx) {
+          vixError = VixDiskLib_InitEx(VIXDISKLIB_VERSION_MAJOR,
+                                       VIXDISKLIB_VERSION_MINOR,
+                                       &LogFunc, &WarnFunc, &PanicFunc,
+                                       appGlobals.libdir,
+                                       appGlobals.cfgFile);
+       } else {
+          vixError = VixDiskLib_Init(VIXDISKLIB_VERSION_MAJOR,
+                                     VIXDISKLIB_VERSION_MINOR,
+                                     NULL, NULL, NULL, // Log, warn, panic
+                                     appGlobals.libdir);
+       }
+       CHECK_AND_THROW(vixError);
+       bVixInit = true;
+
+       if (appGlobals.vmxSpec != NULL) {
+          vixError = VixDiskLib_PrepareForAccess(&cnxParams, "Sample");
+          CHECK_AND_THROW(vixError);
+       }
+       if (appGlobals.ssMoRef == NULL && appGlobals.transportModes == NULL) {
+          vixError = VixDiskLib_Connect(&cnxParams,
+                                        &appGlobals.connection);
+       } else {
+          Bool ro = (appGlobals.openFlags & VIXDISKLIB_FLAG_OPEN_READ_ONLY);
+          vixError = VixDiskLib_ConnectEx(&cnxParams, ro, appGlobals.ssMoRef,
+                                          appGlobals.transportModes,
+                                          &appGlobals.connection);
+       }
+       CHECK_AND_THROW(vixError);
+        if (appGlobals.command & COMMAND_INFO) {
+            DoInfo();
+        } else if (appGlobals.command & COMMAND_CREATE) {
+            DoCreate();
+        } else if (appGlobals.command & COMMAND_REDO) {
+            DoRedo();
+        } else if (appGlobals.command & COMMAND_FILL) {
+            DoFill();
+        } else if (appGlobals.command & COMMAND_DUMP) {
+            DoDump();
+        } else if (appGlobals.command & COMMAND_READ_META) {
+            DoReadMetadata();
+        } else if (appGlobals.command & COMMAND_WRITE_META) {
+            DoWriteMetadata();
+        } else if (appGlobals.command & COMMAND_DUMP_META) {
+            DoDumpMetadata();
+        } else if (appGlobals.command & COMMAND_IMPORT_META) {
+            DoImportMetadata();
+        } else if (appGlobals.command & COMMAND_EXPORT_META) {
+            DoExportMetadata();
+        } else if (appGlobals.command & COMMAND_DIFF_META) {
+            DoDiffMetadata();
+        } else if (appGlobals.command & COMMAND_MULTITHREAD) {
+            DoTestMultiThread();
+        } else if (appGlobals.command & COMMAND_CLONE) {
+            DoClone();
+        } else if (appGlobals.command & COMMAND_COPY) {
+            DoCopy();
+        } else if (appGlobals.command & COMMAND_VERIFY) {
+            DoVerify();
+        } else if (appGlobals.command & COMMAND_DIGEST) {
+            DoDigest();
+        } else if (appGlobals.command & COMMAND_DIFF) {
+            DoDiff();
+        } else if (appGlobals.command & COMMAND_SEARCH) {
+            DoSearch();
+        } else if (appGlobals.command & COMMAND_PROFILE) {
+            DoProfile();
+        } else if (appGlobals.command & COMMAND_READBENCH) {
+            DoRWBench(true);
+        } else if (appGlobals.command & COMMAND_WRITEBENCH) {
+            DoRWBench(false);
+        } else if (appGlobals.command & COMMAND_CHECKREPAIR) {
+            DoCheckRepair(appGlobals.repair);
+        } else if (appGlobals.command & COMMAND_BENCHJOB) {
+            DoBenchJobs();
+        }
+        retval = 0;
+        if (rateLimiter.ThrottledNs() != 0) {
+            printf("Rate limit delayed requests by %d msec in total.\n",
+                   (uint32)(rateLimiter.ThrottledNs() / 1000000));
+        }
+        if (appGlobals.bufStats) {
+            bufferPool.PrintStats();
+        }
+    } catch (const VixDiskLibErrWrapper& e) {
+       cout << "Error: [" << e.File() << ":" << e.Line() << "]  " <<
+               std::hex << e.ErrorCode() << " " << e.Description() << "\n";
+       retval = 1;
+    }
+
+    if (appGlobals.vmxSpec != NULL) {
+       vixError = VixDiskLib_EndAccess(&cnxParams, "Sample");
+    }
+    if (appGlobals.connection != NULL) {
+       VixDiskLib_Disconnect(appGlobals.connection);
+    }
+    if (bVixInit) {
+       VixDiskLib_Exit();
+    }
+    return retval;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ParseArguments --
+ *
+ *      Parses the arguments passed on the command line.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+ParseArguments(int argc, char* argv[])
+{
+    int i;
+    if (argc < 3) {
+        printf("Error: Too few arguments. See usage below.\n\n");
+        return PrintUsage();
+    }
+    for (i = 1; i < argc - 1; i++) {
+        if (!strcmp(argv[i], "-info")) {
+            appGlobals.command |= COMMAND_INFO;
+            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-create")) {
+            appGlobals.command |= COMMAND_CREATE;
+        } else if (!strcmp(argv[i], "-dump")) {
+            appGlobals.command |= COMMAND_DUMP;
             appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
         } else if (!strcmp(argv[i], "-fill")) {
             appGlobals.command |= COMMAND_FILL;
@@ -937,6 +2187,36 @@ ParseArguments(int argc, char* argv[])
             }
             appGlobals.metaKey = argv[++i];
             appGlobals.metaVal = argv[++i];
+        } else if (!strcmp(argv[i], "-metaimport")) {
+            if (i >= argc - 2) {
+                printf("Error: The -metaimport command requires the path of "
+                       "the metadata file to be specified. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.metaFile = argv[++i];
+            appGlobals.command |= COMMAND_IMPORT_META;
+        } else if (!strcmp(argv[i], "-metaexport")) {
+            if (i >= argc - 2) {
+                printf("Error: The -metaexport command requires the path of "
+                       "the metadata file to be specified. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.metaFile = argv[++i];
+            appGlobals.command |= COMMAND_EXPORT_META;
+            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-metadiff")) {
+            appGlobals.command |= COMMAND_DIFF_META;
+            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-disklist")) {
+            if (i >= argc - 2) {
+                printf("Error: The -disklist option requires the path of "
+                       "the disk list to be specified. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.diskList = argv[++i];
         } else if (!strcmp(argv[i], "-redo")) {
             if (i >= argc - 2) {
                 printf("Error: The -redo command requires the parentPath to "
@@ -945,6 +2225,35 @@ ParseArguments(int argc, char* argv[])
             }
             appGlobals.command |= COMMAND_REDO;
             appGlobals.parentPath = argv[++i];
+        } else if (!strcmp(argv[i], "-json")) {
+            appGlobals.json = TRUE;
+        } else if (!strcmp(argv[i], "-raw")) {
+            if (i >= argc - 2) {
+                printf("Error: The -raw option requires a file name to be "
+                       "specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.rawFile = argv[++i];
+        } else if (!strcmp(argv[i], "-fillpattern")) {
+            if (i >= argc - 2) {
+                printf("Error: The -fillpattern option requires a pattern "
+                       "to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            i++;
+            if (!strcmp(argv[i], "byte")) {
+                appGlobals.fillPattern = FILL_BYTE;
+            } else if (!strcmp(argv[i], "zero")) {
+                appGlobals.fillPattern = FILL_ZERO;
+            } else if (!strcmp(argv[i], "lba")) {
+                appGlobals.fillPattern = FILL_LBA;
+            } else if (!strcmp(argv[i], "random")) {
+                appGlobals.fillPattern = FILL_RANDOM;
+            } else {
+                printf("Error: Invalid fill pattern %s. "
+                       "See usage below.\n\n", argv[i]);
+                return PrintUsage();
+            }
         } else if (!strcmp(argv[i], "-val")) {
             if (i >= argc - 2) {
                 printf("Error: The -val option requires a byte value to "
@@ -966,6 +2275,7 @@ ParseArguments(int argc, char* argv[])
                 return PrintUsage();
             }
             appGlobals.numSectors = strtol(argv[++i], NULL, 0);
+            appGlobals.countSpecified = TRUE;
         } else if (!strcmp(argv[i], "-cap")) {
             if (i >= argc - 2) {
                 printf("Error: The -cap option requires the capacity in MB "
@@ -981,18 +2291,94 @@ ParseArguments(int argc, char* argv[])
             }
             appGlobals.srcPath = argv[++i];
             appGlobals.command |= COMMAND_CLONE;
-        } else if (!strcmp(argv[i], "-readbench")) {
-            if (0 && i >= argc - 2) {
-                printf("Error: The -readbench command requires a block size "
-                       "(in sectors) to be specified. See usage below.\n\n");
+        } else if (!strcmp(argv[i], "-copy")) {
+            if (i >= argc - 2) {
+                printf("Error: The -copy command requires the path of the "
+                       "source vmdk to be specified. See usage below.\n\n");
                 return PrintUsage();
             }
-            appGlobals.bufSize = strtol(argv[++i], NULL, 0);
-            appGlobals.command |= COMMAND_READBENCH;
-            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
-        } else if (!strcmp(argv[i], "-writebench")) {
+            appGlobals.srcPath = argv[++i];
+            appGlobals.command |= COMMAND_COPY;
+        } else if (!strcmp(argv[i], "-verify")) {
             if (i >= argc - 2) {
-                printf("Error: The -writebench command requires a block size "
+                printf("Error: The -verify command requires the path of a "
+                       "checksum manifest to be specified. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.verifyFile = argv[++i];
+            appGlobals.command |= COMMAND_VERIFY;
+        } else if (!strcmp(argv[i], "-digest")) {
+            if (i >= argc - 2) {
+                printf("Error: The -digest command requires the path of the "
+                       "digest file to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.digestFile = argv[++i];
+            appGlobals.command |= COMMAND_DIGEST;
+        } else if (!strcmp(argv[i], "-diff")) {
+            if (i >= argc - 2) {
+                printf("Error: The -diff command requires the path of a vmdk "
+                       "or digest file to be specified. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.diffPath = argv[++i];
+            appGlobals.command |= COMMAND_DIFF;
+        } else if (!strcmp(argv[i], "-profile")) {
+            if (i >= argc - 2) {
+                printf("Error: The -profile command requires the path of the "
+                       "CSV file to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.profileFile = argv[++i];
+            appGlobals.command |= COMMAND_PROFILE;
+        } else if (!strcmp(argv[i], "-search")) {
+            string pattern;
+            const char *spec;
+            if (i >= argc - 2) {
+                printf("Error: The -search command requires a pattern to "
+                       "be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            spec = argv[++i];
+            if (!strncmp(spec, "hex:", 4)) {
+                for (spec += 4; isxdigit((unsigned char)spec[0]) &&
+                                isxdigit((unsigned char)spec[1]); spec += 2) {
+                    char byte[3] = { spec[0], spec[1], '\0' };
+
+                    pattern += (char)strtoul(byte, NULL, 16);
+                }
+            } else {
+                pattern = spec;
+                spec = "";
+            }
+            if (pattern.empty() || *spec != '\0') {
+                printf("Error: Invalid search pattern %s. "
+                       "See usage below.\n\n", argv[i]);
+                return PrintUsage();
+            }
+            searchPatterns.push_back(pattern);
+            appGlobals.command |= COMMAND_SEARCH;
+        } else if (!strcmp(argv[i], "-checksum")) {
+            if (i >= argc - 2) {
+                printf("Error: The -checksum option requires the path of a "
+                       "manifest to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.checksumFile = argv[++i];
+        } else if (!strcmp(argv[i], "-readbench")) {
+            if (0 && i >= argc - 2) {
+                printf("Error: The -readbench command requires a block size "
+                       "(in sectors) to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.bufSize = strtol(argv[++i], NULL, 0);
+            appGlobals.command |= COMMAND_READBENCH;
+            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-writebench")) {
+            if (i >= argc - 2) {
+                printf("Error: The -writebench command requires a block size "
                        "(in sectors) to be specified. See usage below.\n\n");
                 return PrintUsage();
             }
@@ -1100,102 +2486,5616 @@ ParseArguments(int argc, char* argv[])
                        "attempted. See usage below.\n\n");
                 return PrintUsage();
             }
-            appGlobals.command |= COMMAND_CHECKREPAIR;
-            appGlobals.repair = strtol(argv[++i], NULL, 0);
-        } else {
-           printf("Error: Unknown command or option: %s\n", argv[i]);
-           return PrintUsage();
-        }
+            appGlobals.command |= COMMAND_CHECKREPAIR;
+            appGlobals.repair = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-threads")) {
+            if (i >= argc - 2) {
+                printf("Error: The -threads option requires the number "
+                       "of threads to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.numThreads = strtol(argv[++i], NULL, 0);
+            if (appGlobals.numThreads < 1) {
+                printf("Error: The -threads option requires at least one "
+                       "thread. See usage below.\n\n");
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-interleave")) {
+            appGlobals.interleave = TRUE;
+        } else if (!strcmp(argv[i], "-pattern")) {
+            if (i >= argc - 2) {
+                printf("Error: The -pattern option requires an access "
+                       "pattern to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            if (!ParsePattern(argv[++i], &appGlobals.pattern)) {
+                printf("Error: Invalid access pattern %s. "
+                       "See usage below.\n\n", argv[i]);
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-job")) {
+            if (i >= argc - 2) {
+                printf("Error: The -job command requires the path of a "
+                       "job file to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.jobFile = argv[++i];
+            appGlobals.command |= COMMAND_BENCHJOB;
+        } else if (!strcmp(argv[i], "-seed")) {
+            if (i >= argc - 2) {
+                printf("Error: The -seed option requires a number to "
+                       "be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.seed = strtoull(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-depth")) {
+            if (i >= argc - 2) {
+                printf("Error: The -depth option requires a number of "
+                       "chunks to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.pipelineDepth = strtoul(argv[++i], NULL, 0);
+            if (appGlobals.pipelineDepth < 2 ||
+                appGlobals.pipelineDepth > MAX_PIPELINE_DEPTH) {
+                printf("Error: The -depth option must be between 2 and %d. "
+                       "See usage below.\n\n", MAX_PIPELINE_DEPTH);
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-readers")) {
+            if (i >= argc - 2) {
+                printf("Error: The -readers option requires a number of "
+                       "threads to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.numReaders = strtoul(argv[++i], NULL, 0);
+            if (appGlobals.numReaders < 1 ||
+                appGlobals.numReaders > MAX_COPY_READERS) {
+                printf("Error: The -readers option must be between 1 and %d. "
+                       "See usage below.\n\n", MAX_COPY_READERS);
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-mbps")) {
+            if (i >= argc - 2) {
+                printf("Error: The -mbps option requires a bandwidth in "
+                       "MBytes/sec to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.limitMBps = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-iops")) {
+            if (i >= argc - 2) {
+                printf("Error: The -iops option requires a number of "
+                       "requests per second to be specified. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.limitIops = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-ratesched")) {
+            if (i >= argc - 2) {
+                printf("Error: The -ratesched option requires a file name "
+                       "to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.rateSchedule = argv[++i];
+        } else if (!strcmp(argv[i], "-resume")) {
+            appGlobals.resume = TRUE;
+        } else if (!strcmp(argv[i], "-fanout")) {
+            appGlobals.fanout = TRUE;
+        } else if (!strcmp(argv[i], "-extents")) {
+            if (i >= argc - 2) {
+                printf("Error: The -extents option requires the path of an "
+                       "extent list to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.extentFile = argv[++i];
+        } else if (!strcmp(argv[i], "-extentunit")) {
+            if (i >= argc - 2 || (strcmp(argv[i + 1], "sectors") &&
+                                  strcmp(argv[i + 1], "bytes"))) {
+                printf("Error: The -extentunit option requires 'sectors' or "
+                       "'bytes' to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.extentBytes = !strcmp(argv[++i], "bytes");
+        } else if (!strcmp(argv[i], "-chunk")) {
+            if (i >= argc - 2) {
+                printf("Error: The -chunk option requires a size in MBytes "
+                       "to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.chunkMB = strtoul(argv[++i], NULL, 0);
+            if (appGlobals.chunkMB < 1 ||
+                appGlobals.chunkMB > MAX_COPY_CHUNK_MB) {
+                printf("Error: The -chunk size must be between 1 and %d "
+                       "MBytes. See usage below.\n\n", MAX_COPY_CHUNK_MB);
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-compress")) {
+            if (i >= argc - 2) {
+                printf("Error: The -compress option requires a percentage "
+                       "to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.compressPct = strtoul(argv[++i], NULL, 0);
+            if (appGlobals.compressPct > 100) {
+                printf("Error: The -compress percentage must be between 0 "
+                       "and 100. See usage below.\n\n");
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-dedup")) {
+            if (i >= argc - 2) {
+                printf("Error: The -dedup option requires a percentage "
+                       "to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.dedupPct = strtoul(argv[++i], NULL, 0);
+            if (appGlobals.dedupPct > 100) {
+                printf("Error: The -dedup percentage must be between 0 "
+                       "and 100. See usage below.\n\n");
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-hugepages")) {
+            appGlobals.hugePages = TRUE;
+        } else if (!strcmp(argv[i], "-lockbufs")) {
+            appGlobals.lockBuffers = TRUE;
+        } else if (!strcmp(argv[i], "-bufstats")) {
+            appGlobals.bufStats = TRUE;
+        } else if (!strcmp(argv[i], "-duration")) {
+            if (i >= argc - 2) {
+                printf("Error: The -duration option requires the number of "
+                       "seconds to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.durationNs = (uint64)(strtod(argv[++i], NULL) * 1e9);
+            if (appGlobals.durationNs == 0) {
+                printf("Error: The -duration option requires a positive "
+                       "number of seconds. See usage below.\n\n");
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-warmup")) {
+            if (i >= argc - 2) {
+                printf("Error: The -warmup option requires the number of "
+                       "seconds to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.warmupNs = (uint64)(strtod(argv[++i], NULL) * 1e9);
+        } else if (!strcmp(argv[i], "-sweep")) {
+            char *range;
+            if (i >= argc - 2) {
+                printf("Error: The -sweep option requires a range of block "
+                       "sizes (in sectors) to be specified. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.sweepMin = strtoull(argv[++i], &range, 0);
+            appGlobals.sweepMax = 0;
+            if (!strncmp(range, "..", 2)) {
+                appGlobals.sweepMax = strtoull(range + 2, NULL, 0);
+            }
+            if (appGlobals.sweepMin < 1 ||
+                appGlobals.sweepMin > appGlobals.sweepMax) {
+                printf("Error: The -sweep option requires a range n..m of "
+                       "block sizes with 1 <= n <= m. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-qd")) {
+            char *range;
+            if (i >= argc - 2) {
+                printf("Error: The -qd option requires a queue depth or a "
+                       "range of queue depths to be specified. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.qdMin = strtoul(argv[++i], &range, 0);
+            appGlobals.qdMax = appGlobals.qdMin;
+            if (!strncmp(range, "..", 2)) {
+                appGlobals.qdMax = strtoul(range + 2, NULL, 0);
+            }
+            if (appGlobals.qdMin < 1 || appGlobals.qdMax > MAX_QUEUE_DEPTH ||
+                appGlobals.qdMin > appGlobals.qdMax) {
+                printf("Error: The -qd option requires queue depths between "
+                       "1 and %d. See usage below.\n\n", MAX_QUEUE_DEPTH);
+                return PrintUsage();
+            }
+        } else {
+           printf("Error: Unknown command or option: %s\n", argv[i]);
+           return PrintUsage();
+        }
+    }
+    appGlobals.diskPath = argv[i];
+
+    if (BitCount(appGlobals.command) != 1) {
+       printf("Error: Missing command. See usage below.\n");
+       return PrintUsage();
+    }
+
+    if (appGlobals.extentFile != NULL &&
+        !(appGlobals.command & (COMMAND_COPY | COMMAND_DIFF))) {
+       printf("Error: -extents requires the -copy or -diff command. ");
+       printf("See usage below.\n");
+       return PrintUsage();
+    }
+
+    if (appGlobals.extentBytes && appGlobals.extentFile == NULL) {
+       printf("Error: -extentunit requires -extents. ");
+       printf("See usage below.\n");
+       return PrintUsage();
+    }
+
+    if (appGlobals.diskList != NULL &&
+        !(appGlobals.command & (COMMAND_IMPORT_META | COMMAND_EXPORT_META |
+                                COMMAND_DIFF_META))) {
+       printf("Error: -disklist requires the -metaimport, -metaexport or "
+              "-metadiff command. ");
+       printf("See usage below.\n");
+       return PrintUsage();
+    }
+
+    if ((appGlobals.command & COMMAND_DIFF_META) &&
+        appGlobals.diskList == NULL) {
+       printf("Error: -metadiff requires -disklist. ");
+       printf("See usage below.\n");
+       return PrintUsage();
+    }
+
+    if (appGlobals.json &&
+        !(appGlobals.command & (COMMAND_DUMP_META | COMMAND_READ_META))) {
+       printf("Error: -json requires the -meta or -rmeta command. ");
+       printf("See usage below.\n");
+       return PrintUsage();
+    }
+
+    if (appGlobals.rawFile != NULL && !(appGlobals.command & COMMAND_DUMP)) {
+       printf("Error: -raw requires the -dump command. ");
+       printf("See usage below.\n");
+       return PrintUsage();
+    }
+
+    if (appGlobals.checksumFile != NULL &&
+        (!(appGlobals.command & COMMAND_COPY) || appGlobals.resume)) {
+       printf("Error: -checksum requires the -copy command without -resume. ");
+       printf("See usage below.\n");
+       return PrintUsage();
+    }
+
+    if (appGlobals.resume &&
+        (!(appGlobals.command & COMMAND_COPY) || appGlobals.extentFile)) {
+       printf("Error: -resume requires the -copy command without -extents. ");
+       printf("See usage below.\n");
+       return PrintUsage();
+    }
+
+    if (appGlobals.rateSchedule != NULL &&
+        (appGlobals.limitMBps != 0 || appGlobals.limitIops != 0)) {
+       printf("Error: -ratesched cannot be combined with -mbps or -iops. ");
+       printf("See usage below.\n");
+       return PrintUsage();
+    }
+    rateLimiter.SetLimits((uint64)appGlobals.limitMBps * 1024 * 1024,
+                          appGlobals.limitIops);
+    if (appGlobals.rateSchedule != NULL &&
+        !rateLimiter.LoadSchedule(appGlobals.rateSchedule)) {
+       return 1;
+    }
+
+    if (appGlobals.sweepMin != 0 && appGlobals.qdMin != appGlobals.qdMax) {
+       printf("Error: -sweep requires a single -qd queue depth. ");
+       printf("See usage below.\n");
+       return PrintUsage();
+    }
+
+    if (appGlobals.isRemote) {
+       if (appGlobals.host == NULL ||
+           appGlobals.userName == NULL ||
+           appGlobals.password == NULL) {
+           printf("Error: Missing a mandatory option. ");
+           printf("-host, -user and -password must be specified. ");
+           printf("See usage below.\n");
+           return PrintUsage();
+       }
+    }
+
+    /*
+     * TODO: More error checking for params, really
+     */
+    return 0;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoInfo --
+ *
+ *      Queries the information of a virtual disk.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoInfo(void)
+{
+    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
+    VixDiskLibInfo *info = NULL;
+    VixError vixError;
+
+    vixError = VixDiskLib_GetInfo(disk.Handle(), &info);
+
+    CHECK_AND_THROW(vixError);
+
+    cout << "capacity          = " << info->capacity << " sectors" << endl;
+    cout << "number of links   = " << info->numLinks << endl;
+    cout << "adapter type      = ";
+    switch (info->adapterType) {
+    case VIXDISKLIB_ADAPTER_IDE:
+       cout << "IDE" << endl;
+       break;
+    case VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC:
+       cout << "BusLogic SCSI" << endl;
+       break;
+    case VIXDISKLIB_ADAPTER_SCSI_LSILOGIC:
+       cout << "LsiLogic SCSI" << endl;
+       break;
+    default:
+       cout << "unknown" << endl;
+       break;
+    }
+
+    cout << "BIOS geometry     = " << info->biosGeo.cylinders <<
+       "/" << info->biosGeo.heads << "/" << info->biosGeo.sectors << endl;
+
+    cout << "physical geometry = " << info->physGeo.cylinders <<
+       "/" << info->physGeo.heads << "/" << info->physGeo.sectors << endl;
+
+    VixDiskLib_FreeInfo(info);
+
+    cout << "Transport modes supported by vixDiskLib: " <<
+       VixDiskLib_ListTransportModes() << endl;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoCreate --
+ *
+ *      Creates a virtual disk.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoCreate(void)
+{
+   VixDiskLibCreateParams createParams;
+   VixError vixError;
+
+   createParams.adapterType = appGlobals.adapterType;
+
+   createParams.capacity = appGlobals.mbSize * 2048;
+   createParams.diskType = VIXDISKLIB_DISK_MONOLITHIC_SPARSE;
+   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+
+   vixError = VixDiskLib_Create(appGlobals.connection,
+                                appGlobals.diskPath,
+                                &createParams,
+                                NULL,
+                                NULL);
+   CHECK_AND_THROW(vixError);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoRedo --
+ *
+ *      Creates a child disk.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoRedo(void)
+{
+   VixError vixError;
+   VixDisk parentDisk(appGlobals.connection, appGlobals.parentPath, 0);
+   vixError = VixDiskLib_CreateChild(parentDisk.Handle(),
+                                     appGlobals.diskPath,
+                                     VIXDISKLIB_DISK_MONOLITHIC_SPARSE,
+                                     NULL, NULL);
+   CHECK_AND_THROW(vixError);
+}
+
+
+// Progress of -fill is printed about every FILL_REPORT_NS.
+#define FILL_REPORT_NS (1000000000ULL)
+
+// State shared by the threads of DoFill. Generator threads claim chunks
+// in order and fill a free buffer with the -fillpattern data of its
+// sectors; the calling thread writes the full buffers to the disk.
+struct FillState {
+   explicit FillState(uint32 depth) // IN
+      : free(BoundedRing<PipelineChunk>::CapacityFor(depth)),
+        full(BoundedRing<PipelineChunk>::CapacityFor(depth)),
+        nextChunk(0),
+        stop(false)
+   {
+   }
+
+   VixDiskLibSectorType startSector;
+   VixDiskLibSectorType numSectors;
+   VixDiskLibSectorType chunkSectors;
+   BoundedRing<PipelineChunk> free;
+   BoundedRing<PipelineChunk> full;
+   std::atomic<uint64> nextChunk;
+   std::atomic<bool> stop;
+};
+
+static TaskResult TASK_CALL FillThread(void *arg);
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoFill --
+ *
+ *      Writes to a virtual disk: -count sectors from -start with the
+ *      -fillpattern data, in -chunk sized writes. As a disk can only be
+ *      opened for writing once, the data is produced by appGlobals.
+ *      numThreads generator threads while this thread writes it through
+ *      the one handle, with up to -depth chunks in between.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoFill(void)
+{
+    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
+    VixDiskLibSectorType chunkSectors = appGlobals.chunkMB * 2048;
+    uint32 depth = appGlobals.pipelineDepth;
+    FillState state(depth);
+    IoBuffer bufs(depth * chunkSectors * VIXDISKLIB_SECTOR_SIZE);
+    vector<ThreadHandle> threads;
+    VixDiskLibSectorType written = 0;
+    VixError vixError = VIX_OK;
+    uint64 startNs, reportNs, now;
+    uint32 i;
+
+    state.startSector = appGlobals.startSector;
+    state.numSectors = appGlobals.numSectors;
+    state.chunkSectors = chunkSectors;
+    for (i = 0; i < depth; i++) {
+       PipelineChunk chunk;
+
+       chunk.buf = bufs.Get() + i * chunkSectors * VIXDISKLIB_SECTOR_SIZE;
+       state.free.TryPush(chunk);
+    }
+
+    startNs = GetTimeNs();
+    reportNs = startNs + FILL_REPORT_NS;
+    for (i = 0; i < appGlobals.numThreads; i++) {
+       threads.push_back(StartThread(&FillThread, &state));
+    }
+    while (written < appGlobals.numSectors) {
+       PipelineChunk chunk;
+
+       state.full.Pop(&chunk);
+       rateLimiter.Acquire(chunk.numSectors);
+       vixError = VixDiskLib_Write(disk.Handle(), chunk.sector,
+                                   chunk.numSectors, chunk.buf);
+       if (VIX_FAILED(vixError)) {
+          break;
+       }
+       written += chunk.numSectors;
+       state.free.TryPush(chunk);
+
+       now = GetTimeNs();
+       if (now >= reportNs && written < appGlobals.numSectors) {
+          printf("Filled %d of %d MBytes (%d MBytes/sec)\n",
+                 (uint32)(written / 2048),
+                 (uint32)(appGlobals.numSectors / 2048),
+                 (uint32)(written * VIXDISKLIB_SECTOR_SIZE * 1e3 /
+                          (1024 * 1024) / ((now - startNs) / 1e6)));
+          reportNs = now + FILL_REPORT_NS;
+       }
+    }
+    state.stop.store(true);
+    state.free.Close();
+    for (i = 0; i < threads.size(); i++) {
+       JoinThread(threads[i]);
+    }
+    CHECK_AND_THROW(vixError);
+
+    now = GetTimeNs();
+    printf("Filled %d MBytes in %d msec (%d MBytes/sec)\n",
+           (uint32)(written / 2048), (uint32)((now - startNs) / 1000000),
+           (uint32)(written * VIXDISKLIB_SECTOR_SIZE * 1e3 / (1024 * 1024) /
+                    std::max((now - startNs) / 1e6, 1e-3)));
+}
+
+
+// Initial size of the MetadataReader buffers; most values fit.
+#define METADATA_BUFSIZE 4096
+
+// Reads the metadata of an open disk into buffers kept across calls.
+// Every read is tried with the current buffer first; only when it fails
+// with VIX_E_BUFFER_TOOSMALL is the buffer grown to the required size
+// and the read repeated, so a value usually takes one round trip.
+
+class MetadataReader
+{
+public:
+    explicit MetadataReader(VixDiskLibHandle handle) // IN
+       : _handle(handle),
+         _keys(METADATA_BUFSIZE),
+         _value(METADATA_BUFSIZE)
+    {
+    }
+
+    // Returns the keys, each NUL-terminated, followed by an empty key.
+    const char *Keys()
+    {
+       size_t requiredLen = 0;
+       VixError vixError = VixDiskLib_GetMetadataKeys(_handle, &_keys[0],
+                                                      _keys.size(),
+                                                      &requiredLen);
+
+       if (vixError == VIX_E_BUFFER_TOOSMALL) {
+          _keys.resize(requiredLen);
+          vixError = VixDiskLib_GetMetadataKeys(_handle, &_keys[0],
+                                                _keys.size(), NULL);
+       }
+       CHECK_AND_THROW(vixError);
+       return &_keys[0];
+    }
+
+    // Returns the value of key, valid until the next call.
+    const char *Read(const char *key) // IN
+    {
+       size_t requiredLen = 0;
+       VixError vixError = VixDiskLib_ReadMetadata(_handle, key, &_value[0],
+                                                   _value.size(),
+                                                   &requiredLen);
+
+       if (vixError == VIX_E_BUFFER_TOOSMALL) {
+          _value.resize(requiredLen);
+          vixError = VixDiskLib_ReadMetadata(_handle, key, &_value[0],
+                                             _value.size(), NULL);
+       }
+       CHECK_AND_THROW(vixError);
+       return &_value[0];
+    }
+
+private:
+    VixDiskLibHandle _handle;
+    vector<char> _keys;
+    vector<char> _value;
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Utf8SequenceLength --
+ *
+ *      Checks for a well-formed UTF-8 sequence of more than one byte at
+ *      str: no overlong forms, surrogates or code points past U+10FFFF.
+ *
+ * Results:
+ *      Length of the sequence, or 0 if there is none.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static size_t
+Utf8SequenceLength(const unsigned char *str) // IN
+{
+   unsigned char lo = 0x80, hi = 0xBF;
+   size_t len, i;
+
+   if (str[0] >= 0xC2 && str[0] <= 0xDF) {
+      len = 2;
+   } else if (str[0] >= 0xE0 && str[0] <= 0xEF) {
+      len = 3;
+      lo = str[0] == 0xE0 ? 0xA0 : 0x80;
+      hi = str[0] == 0xED ? 0x9F : 0xBF;
+   } else if (str[0] >= 0xF0 && str[0] <= 0xF4) {
+      len = 4;
+      lo = str[0] == 0xF0 ? 0x90 : 0x80;
+      hi = str[0] == 0xF4 ? 0x8F : 0xBF;
+   } else {
+      return 0;
+   }
+   // Only the second byte has a narrower range; a NUL ends the check.
+   for (i = 1; i < len; i++) {
+      if (str[i] < lo || str[i] > hi) {
+         return 0;
+      }
+      lo = 0x80;
+      hi = 0xBF;
+   }
+   return len;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendJsonString --
+ *
+ *      Appends a string to out as a quoted JSON string. Well-formed
+ *      UTF-8 is copied; any other byte of 0x80 and up is escaped as the
+ *      code point of the same value, so the output is always valid.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AppendJsonString(const char *str,   // IN
+                 string &out)       // IN/OUT
+{
+   static const char digits[] = "0123456789abcdef";
+   const char *run = str;
+
+   out += '"';
+   for (; *str != '\0'; str++) {
+      unsigned char c = *str;
+      size_t len;
+
+      if (c >= 0x80 &&
+          (len = Utf8SequenceLength((const unsigned char *)str)) != 0) {
+         str += len - 1;
+         continue;
+      }
+      if (c >= ' ' && c < 0x80 && c != '"' && c != '\\') {
+         continue;
+      }
+      out.append(run, str - run);
+      run = str + 1;
+      out += '\\';
+      switch (c) {
+      case '"':
+      case '\\':
+         out += (char)c;
+         break;
+      case '\n':
+         out += 'n';
+         break;
+      case '\r':
+         out += 'r';
+         break;
+      case '\t':
+         out += 't';
+         break;
+      default:
+         out += "u00";
+         out += digits[c >> 4];
+         out += digits[c & 0xF];
+         break;
+      }
+   }
+   out.append(run, str - run);
+   out += '"';
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoReadMetadata --
+ *
+ *      Reads metadata from a virtual disk.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoReadMetadata(void)
+{
+    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
+    MetadataReader reader(disk.Handle());
+    const char *value = reader.Read(appGlobals.metaKey);
+
+    if (appGlobals.json) {
+       string out = "{";
+
+       AppendJsonString(appGlobals.metaKey, out);
+       out += ": ";
+       AppendJsonString(value, out);
+       out += "}\n";
+       fwrite(out.data(), 1, out.size(), stdout);
+    } else {
+       cout << appGlobals.metaKey << " = " << value << endl;
+    }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoWriteMetadata --
+ *
+ *      Writes metadata in a virtual disk.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoWriteMetadata(void)
+{
+    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
+    VixError vixError = VixDiskLib_WriteMetadata(disk.Handle(),
+                                                 appGlobals.metaKey,
+                                                 appGlobals.metaVal);
+    CHECK_AND_THROW(vixError);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoDumpMetadata --
+ *
+ *      Dumps all the metadata, as "key = value" lines or, with -json, as
+ *      one JSON object, written out at once.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoDumpMetadata(void)
+{
+    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
+    MetadataReader reader(disk.Handle());
+    const char *key;
+    string out;
+
+    if (appGlobals.json) {
+       out = "{\"disk\": ";
+       AppendJsonString(appGlobals.diskPath, out);
+       out += ", \"metadata\": {";
+    }
+    for (key = reader.Keys(); *key; key += 1 + strlen(key)) {
+        const char *value = reader.Read(key);
+
+        if (appGlobals.json) {
+           if (out[out.size() - 1] != '{') {
+              out += ", ";
+           }
+           AppendJsonString(key, out);
+           out += ": ";
+           AppendJsonString(value, out);
+        } else {
+           out += key;
+           out += " = ";
+           out += value;
+           out += '\n';
+        }
+    }
+    if (appGlobals.json) {
+       out += "}}\n";
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ReadTextLine --
+ *
+ *      Reads one line of any length from file, without the line end.
+ *
+ * Results:
+ *      false at the end of the file.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static bool
+ReadTextLine(FILE *file,   // IN
+             string &line) // OUT
+{
+   char buf[256];
+
+   line.clear();
+   while (fgets(buf, sizeof buf, file) != NULL) {
+      line += buf;
+      if (line[line.size() - 1] == '\n') {
+         break;
+      }
+   }
+   if (line.empty()) {
+      return false;
+   }
+   while (!line.empty() &&
+          (line[line.size() - 1] == '\n' || line[line.size() - 1] == '\r')) {
+      line.erase(line.size() - 1);
+   }
+   return true;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * LoadMetadataDisks --
+ *
+ *      Lists the disks of a bulk metadata command: diskPath, followed by
+ *      the paths in the -disklist file, one per line.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Throws if the disk list cannot be read.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+LoadMetadataDisks(vector<string> &disks) // OUT
+{
+   FILE *file;
+   string line;
+
+   disks.assign(1, appGlobals.diskPath);
+   if (appGlobals.diskList == NULL) {
+      return;
+   }
+   file = fopen(appGlobals.diskList, "r");
+   if (file == NULL) {
+      printf("Error: Cannot open disk list %s.\n", appGlobals.diskList);
+      THROW_ERROR(VIX_E_FILE_NOT_FOUND);
+   }
+   while (ReadTextLine(file, line)) {
+      size_t first = line.find_first_not_of(" \t");
+
+      if (first != string::npos && line[first] != '#') {
+         disks.push_back(line.substr(first,
+                                     line.find_last_not_of(" \t") + 1 - first));
+      }
+   }
+   fclose(file);
+}
+
+
+// Key and value pairs of a metadata file, in file order.
+typedef vector<std::pair<string, string> > MetadataEntries;
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * EscapeMetadataText --
+ *
+ *      Appends a key, value or disk path to a -metaexport line, so that
+ *      UnescapeMetadataText reads it back unchanged: backslashes and line
+ *      breaks are escaped, and so are the characters in special (for a
+ *      key, '=') and a leading '[' or '#'.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+EscapeMetadataText(const string &text,     // IN
+                   const char *special,    // IN
+                   bool leading,           // IN: escape a leading '[' or '#'
+                   string &out)            // IN/OUT
+{
+   size_t i;
+
+   for (i = 0; i < text.size(); i++) {
+      char c = text[i];
+
+      if (c == '\n') {
+         out += "\\n";
+      } else if (c == '\r') {
+         out += "\\r";
+      } else if (c == '\\' || strchr(special, c) != NULL ||
+                 (i == 0 && leading && (c == '[' || c == '#'))) {
+         out += '\\';
+         out += c;
+      } else {
+         out += c;
+      }
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * UnescapeMetadataText --
+ *
+ *      Undoes EscapeMetadataText on part of a -metaimport line.
+ *
+ * Results:
+ *      false if the text ends in a lone backslash.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static bool
+UnescapeMetadataText(const string &line,   // IN
+                     size_t begin,         // IN
+                     size_t end,           // IN
+                     string &text)         // OUT
+{
+   size_t i;
+
+   text.clear();
+   for (i = begin; i < end; i++) {
+      if (line[i] != '\\') {
+         text += line[i];
+         continue;
+      }
+      if (++i == end) {
+         return false;
+      }
+      text += line[i] == 'n' ? '\n' : line[i] == 'r' ? '\r' : line[i];
+   }
+   return true;
+}
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * LoadMetadataFile --
+ *
+ *      Reads a -metaimport file of "key=value" lines. Entries before the
+ *      first "[diskPath]" line apply to every disk, entries after it only
+ *      to that disk, as written by -metaexport. Keys, values and paths
+ *      are unescaped, and a key ends at the first unescaped '='.
+ *
+ * Results:
+ *      false if the file cannot be read or has an invalid line.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static bool
+LoadMetadataFile(const char *path,                        // IN
+                 std::map<string, MetadataEntries> &sets) // OUT
+{
+   FILE *file = fopen(path, "r");
+   MetadataEntries *entries = &sets[""];
+   string line;
+   unsigned lineNo = 0;
+
+   if (file == NULL) {
+      printf("Error: Cannot open metadata file %s.\n", path);
+      return false;
+   }
+   while (ReadTextLine(file, line)) {
+      string key, value;
+      size_t eq;
+
+      lineNo++;
+      if (line.empty() || line[0] == '#') {
+         continue;
+      }
+      if (line[0] == '[' && line[line.size() - 1] == ']' &&
+          UnescapeMetadataText(line, 1, line.size() - 1, key)) {
+         entries = &sets[key];
+         continue;
+      }
+      for (eq = 0; eq < line.size() && line[eq] != '='; eq++) {
+         eq += line[eq] == '\\';
+      }
+      if (eq == 0 || eq >= line.size() ||
+          !UnescapeMetadataText(line, 0, eq, key) ||
+          !UnescapeMetadataText(line, eq + 1, line.size(), value)) {
+         printf("Error: %s:%d: expected 'key=value'.\n", path, lineNo);
+         fclose(file);
+         return false;
+      }
+      entries->push_back(std::make_pair(key, value));
+   }
+   fclose(file);
+   return true;
+}
+
+
+// Called by ForEachMetadataDisk with every open disk.
+typedef void (*MetadataDiskFunc)(const string &path,      // IN
+                                 VixDiskLibHandle handle, // IN
+                                 void *data);             // IN/OUT
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ForEachMetadataDisk --
+ *
+ *      Opens the disks of a bulk metadata command from index first on in
+ *      turn, over the one connection, and calls fn with each. An error on
+ *      one disk is printed and the run goes on with the next.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Throws at the end if any disk failed.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+ForEachMetadataDisk(const vector<string> &disks, // IN
+                    size_t first,                // IN
+                    MetadataDiskFunc fn,         // IN
+                    void *data)                  // IN/OUT
+{
+   size_t i, failed = 0;
+
+   for (i = first; i < disks.size(); i++) {
+      try {
+         VixDisk disk(appGlobals.connection, disks[i].c_str(),
+                      appGlobals.openFlags);
+
+         fn(disks[i], disk.Handle(), data);
+      } catch (const VixDiskLibErrWrapper &e) {
+         printf("Error: %s: %s\n", disks[i].c_str(), e.Description().c_str());
+         failed++;
+      }
+   }
+   if (failed != 0) {
+      printf("Failed on %d of %d disks.\n", (uint32)failed,
+             (uint32)(disks.size() - first));
+      THROW_ERROR(VIX_E_FAIL);
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ReadAllMetadata --
+ *
+ *      Reads every metadata entry of an open disk.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+ReadAllMetadata(VixDiskLibHandle handle,             // IN
+                std::map<string, string> &metadata)  // OUT
+{
+   MetadataReader reader(handle);
+   const char *key;
+
+   metadata.clear();
+   for (key = reader.Keys(); *key; key += 1 + strlen(key)) {
+      metadata[key] = reader.Read(key);
+   }
+}
+
+
+// State of a -metaimport run.
+struct ImportMetadataData {
+   std::map<string, MetadataEntries> sets;
+   uint64 numWritten;
+};
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ImportMetadataDisk --
+ *
+ *      Writes the entries for all disks, then those for this disk.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+ImportMetadataDisk(const string &path,      // IN
+                   VixDiskLibHandle handle, // IN
+                   void *data)              // IN/OUT
+{
+   ImportMetadataData *import = (ImportMetadataData *)data;
+   std::map<string, MetadataEntries>::const_iterator own;
+   const MetadataEntries *lists[2];
+   size_t l, e;
+
+   lists[0] = &import->sets[""];
+   own = import->sets.find(path);
+   lists[1] = own != import->sets.end() ? &own->second : NULL;
+   for (l = 0; l < 2 && lists[l] != NULL; l++) {
+      for (e = 0; e < lists[l]->size(); e++) {
+         VixError vixError =
+            VixDiskLib_WriteMetadata(handle, (*lists[l])[e].first.c_str(),
+                                     (*lists[l])[e].second.c_str());
+         CHECK_AND_THROW(vixError);
+         import->numWritten++;
+      }
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoImportMetadata --
+ *
+ *      Writes the entries of a metadata file into every disk, opening
+ *      each disk once.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Throws before writing anything if a [path] section of the file
+ *      is not one of the disks.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoImportMetadata(void)
+{
+   ImportMetadataData import;
+   std::map<string, MetadataEntries>::const_iterator it;
+   vector<string> disks;
+   bool unmatched = false;
+
+   import.numWritten = 0;
+   if (!LoadMetadataFile(appGlobals.metaFile, import.sets)) {
+      THROW_ERROR(VIX_E_INVALID_ARG);
+   }
+   LoadMetadataDisks(disks);
+   for (it = import.sets.begin(); it != import.sets.end(); ++it) {
+      if (!it->first.empty() &&
+          std::find(disks.begin(), disks.end(), it->first) == disks.end()) {
+         printf("Error: %s: [%s] is neither diskPath nor a -disklist "
+                "disk.\n", appGlobals.metaFile, it->first.c_str());
+         unmatched = true;
+      }
+   }
+   if (unmatched) {
+      THROW_ERROR(VIX_E_INVALID_ARG);
+   }
+   ForEachMetadataDisk(disks, 0, ImportMetadataDisk, &import);
+   printf("Wrote %" FMT64 "u metadata entries to %d disks.\n",
+          import.numWritten, (uint32)disks.size());
+}
+
+
+// State of a -metaexport run.
+struct ExportMetadataData {
+   FILE *file;
+   bool sections;
+};
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ExportMetadataDisk --
+ *
+ *      Appends the metadata of a disk to the export file.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+ExportMetadataDisk(const string &path,      // IN
+                   VixDiskLibHandle handle, // IN
+                   void *data)              // IN/OUT
+{
+   ExportMetadataData *exp = (ExportMetadataData *)data;
+   MetadataReader reader(handle);
+   const char *key;
+   string out;
+
+   if (exp->sections) {
+      out = "[";
+      EscapeMetadataText(path, "", false, out);
+      out += "]\n";
+   }
+   for (key = reader.Keys(); *key; key += 1 + strlen(key)) {
+      EscapeMetadataText(key, "=", true, out);
+      out += '=';
+      EscapeMetadataText(reader.Read(key), "", false, out);
+      out += '\n';
+   }
+   fwrite(out.data(), 1, out.size(), exp->file);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoExportMetadata --
+ *
+ *      Saves the metadata of every disk to a file that -metaimport reads
+ *      back. With -disklist, the entries of each disk follow a
+ *      "[diskPath]" line.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoExportMetadata(void)
+{
+   ExportMetadataData exp;
+   vector<string> disks;
+
+   LoadMetadataDisks(disks);
+   exp.sections = disks.size() > 1;
+   exp.file = fopen(appGlobals.metaFile, "w");
+   if (exp.file == NULL) {
+      printf("Error: Cannot create metadata file %s.\n", appGlobals.metaFile);
+      THROW_ERROR(VIX_E_FAIL);
+   }
+   try {
+      ForEachMetadataDisk(disks, 0, ExportMetadataDisk, &exp);
+   } catch (...) {
+      fclose(exp.file);
+      throw;
+   }
+   if (fclose(exp.file) != 0) {
+      printf("Error: Cannot write metadata file %s.\n", appGlobals.metaFile);
+      THROW_ERROR(VIX_E_FAIL);
+   }
+}
+
+
+// State of a -metadiff run.
+struct DiffMetadataData {
+   std::map<string, string> reference;
+   size_t numDiffering;
+};
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DiffMetadataDisk --
+ *
+ *      Prints the keys of a disk that are missing (-), added (+) or
+ *      changed (!) compared to the reference disk.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DiffMetadataDisk(const string &path,      // IN
+                 VixDiskLibHandle handle, // IN
+                 void *data)              // IN/OUT
+{
+   DiffMetadataData *diff = (DiffMetadataData *)data;
+   std::map<string, string> metadata;
+   std::map<string, string>::const_iterator ref, cur;
+   string out;
+
+   ReadAllMetadata(handle, metadata);
+
+   // Both maps are sorted by key, so walk them together.
+   ref = diff->reference.begin();
+   cur = metadata.begin();
+   while (ref != diff->reference.end() || cur != metadata.end()) {
+      if (cur == metadata.end() ||
+          (ref != diff->reference.end() && ref->first < cur->first)) {
+         out += "   - " + ref->first + " = " + ref->second + "\n";
+         ++ref;
+      } else if (ref == diff->reference.end() || cur->first < ref->first) {
+         out += "   + " + cur->first + " = " + cur->second + "\n";
+         ++cur;
+      } else {
+         if (ref->second != cur->second) {
+            out += "   ! " + cur->first + " = " + cur->second +
+                   " (was " + ref->second + ")\n";
+         }
+         ++ref;
+         ++cur;
+      }
+   }
+   if (!out.empty()) {
+      printf("%s:\n%s", path.c_str(), out.c_str());
+      diff->numDiffering++;
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoDiffMetadata --
+ *
+ *      Compares the metadata of every -disklist disk with that of
+ *      diskPath.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoDiffMetadata(void)
+{
+   DiffMetadataData diff;
+   vector<string> disks;
+
+   LoadMetadataDisks(disks);
+   {
+      VixDisk disk(appGlobals.connection, appGlobals.diskPath,
+                   appGlobals.openFlags);
+
+      ReadAllMetadata(disk.Handle(), diff.reference);
+   }
+   diff.numDiffering = 0;
+   ForEachMetadataDisk(disks, 1, DiffMetadataDisk, &diff);
+   printf("%d of %d disks differ from %s.\n", (uint32)diff.numDiffering,
+          (uint32)(disks.size() - 1), appGlobals.diskPath);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoDump --
+ *
+ *      Dumps the content of a virtual disk, in hexadecimal to stdout or,
+ *      with -raw, as binary to a file. Sectors are read and written out
+ *      DUMP_BATCH_SECTORS at a time.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoDump(void)
+{
+    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
+    IoBuffer buf(DUMP_BATCH_SECTORS * VIXDISKLIB_SECTOR_SIZE);
+    vector<char> text;
+    FILE *raw = NULL;
+    VixDiskLibSectorType i, j;
+
+    if (appGlobals.rawFile != NULL) {
+       raw = fopen(appGlobals.rawFile, "wb");
+       if (raw == NULL) {
+          printf("Error: Cannot create %s.\n", appGlobals.rawFile);
+          THROW_ERROR(VIX_E_FAIL);
+       }
+    } else {
+       text.resize(DUMP_BATCH_SECTORS *
+                   (VIXDISKLIB_SECTOR_SIZE / DUMP_BYTES_PER_LINE *
+                    DUMP_LINE_MAX + 1));
+    }
+
+    try {
+       for (i = 0; i < appGlobals.numSectors; i += DUMP_BATCH_SECTORS) {
+          VixDiskLibSectorType numSectors =
+             std::min((VixDiskLibSectorType)DUMP_BATCH_SECTORS,
+                      appGlobals.numSectors - i);
+          VixError vixError;
+          size_t len = 0;
+
+          rateLimiter.Acquire(numSectors);
+          vixError = VixDiskLib_Read(disk.Handle(),
+                                     appGlobals.startSector + i,
+                                     numSectors, buf.Get());
+          CHECK_AND_THROW(vixError);
+          if (raw != NULL) {
+             if (fwrite(buf.Get(), VIXDISKLIB_SECTOR_SIZE, numSectors,
+                        raw) != numSectors) {
+                printf("Error: Cannot write to %s.\n", appGlobals.rawFile);
+                THROW_ERROR(VIX_E_FAIL);
+             }
+             continue;
+          }
+          for (j = 0; j < numSectors; j++) {
+             len += DumpBytes(buf.Get() + j * VIXDISKLIB_SECTOR_SIZE,
+                              VIXDISKLIB_SECTOR_SIZE, DUMP_BYTES_PER_LINE,
+                              &text[len]);
+          }
+          fwrite(&text[0], 1, len, stdout);
+       }
+    } catch (const VixDiskLibErrWrapper &) {
+       if (raw != NULL) {
+          fclose(raw);
+       }
+       throw;
+    }
+    if (raw != NULL && fclose(raw) != 0) {
+       printf("Error: Cannot write to %s.\n", appGlobals.rawFile);
+       THROW_ERROR(VIX_E_FAIL);
+    }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * BitCount --
+ *
+ *      Counts all the bits set in an int.
+ *
+ * Results:
+ *      Number of bits set to 1.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+BitCount(int number)    // IN
+{
+    int bits = 0;
+    while (number) {
+        number = number & (number - 1);
+        bits++;
+    }
+    return bits;
+}
+
+
+// Text of every byte value in a hex dump: two hex digits and a space,
+// and the byte itself, or '.' if it is not printable.
+
+class HexDumpTables
+{
+public:
+    HexDumpTables()
+    {
+       static const char digits[] = "0123456789abcdef";
+       int c;
+
+       for (c = 0; c < 256; c++) {
+          hex[c][0] = digits[c >> 4];
+          hex[c][1] = digits[c & 0xF];
+          hex[c][2] = ' ';
+          ascii[c] = c < ' ' || c >= 127 ? '.' : (char)c;
+       }
+    }
+
+    char hex[256][3];
+    char ascii[256];
+};
+
+static HexDumpTables hexDumpTables;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DumpBytes --
+ *
+ *      Formats an array of n bytes as lines of step bytes, each with its
+ *      offset, in hexadecimal and in ASCII, followed by an empty line.
+ *      out must have room for DUMP_LINE_MAX characters per line (with
+ *      step at most DUMP_BYTES_PER_LINE) and one more.
+ *
+ * Results:
+ *      Number of characters written to out.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static size_t
+DumpBytes(const unsigned char *buf,     // IN
+          size_t n,                     // IN
+          int step,                     // IN
+          char *out)                    // OUT
+{
+   size_t lines = n / step;
+   char *p = out;
+   size_t i;
+
+   for (i = 0; i < lines; i++) {
+      const unsigned char *line = buf + i * step;
+      size_t offset = i * step;
+      int k, digits = 4;
+
+      while (digits < 16 && (offset >> (4 * digits)) != 0) {
+         digits++;
+      }
+      for (k = digits - 1; k >= 0; k--) {
+         *p++ = hexDumpTables.hex[(offset >> (4 * k)) & 0xF][1];
+      }
+      memcpy(p, " : ", 3);
+      p += 3;
+      for (k = 0; k < step; k++, p += 3) {
+         memcpy(p, hexDumpTables.hex[line[k]], 3);
+      }
+      *p++ = ' ';
+      *p++ = ' ';
+      for (k = 0; k < step; k++) {
+         *p++ = hexDumpTables.ascii[line[k]];
+      }
+      *p++ = '\n';
+   }
+   *p++ = '\n';
+   return p - out;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyGranule --
+ *
+ *      Granularity of copies, for allocation queries and checkpoints:
+ *      the largest power of two dividing the -chunk size, so that every
+ *      chunk of a granule-aligned extent covers whole granules.
+ *
+ * Results:
+ *      Granule size in sectors.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VixDiskLibSectorType
+CopyGranule(void)
+{
+   VixDiskLibSectorType chunkSectors = appGlobals.chunkMB * 2048;
+
+   return chunkSectors & ~(chunkSectors - 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * QueryAllocatedExtents --
+ *
+ *      Lists the allocated extents of the first capacity sectors of a
+ *      disk with VixDiskLib_QueryAllocatedBlocks, in granules of
+ *      granule sectors (a power of two, at least
+ *      VIXDISKLIB_MIN_CHUNK_SIZE). Adjacent extents are merged; a tail
+ *      smaller than a granule is reported as allocated.
+ *
+ * Results:
+ *      false if the disk or transport cannot report allocation, in
+ *      which case extents holds a single extent spanning the disk.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+QueryAllocatedExtents(VixDiskLibHandle handle,          // IN
+                      VixDiskLibSectorType capacity,    // IN
+                      VixDiskLibSectorType granule,     // IN
+                      vector<VixDiskLibBlock> &extents) // OUT
+{
+   VixDiskLibSectorType window = granule * VIXDISKLIB_MAX_CHUNK_NUMBER;
+   VixDiskLibSectorType aligned = capacity - capacity % granule;
+   VixDiskLibSectorType start;
+   uint32 i;
+
+   extents.clear();
+   for (start = 0; start < aligned; start += window) {
+      VixDiskLibBlockList *list = NULL;
+      VixError vixError;
+
+      vixError = VixDiskLib_QueryAllocatedBlocks(handle, start,
+                                                 std::min(window, aligned - start),
+                                                 granule, &list);
+      if (VIX_FAILED(vixError)) {
+         VixDiskLibBlock all = { 0, capacity };
+
+         extents.assign(1, all);
+         return false;
+      }
+      for (i = 0; i < list->numBlocks; i++) {
+         VixDiskLibBlock block = list->blocks[i];
+
+         if (!extents.empty() &&
+             extents.back().offset + extents.back().length == block.offset) {
+            extents.back().length += block.length;
+         } else {
+            extents.push_back(block);
+         }
+      }
+      VixDiskLib_FreeBlockList(list);
+   }
+   if (aligned < capacity) {
+      VixDiskLibBlock tail = { aligned, capacity - aligned };
+
+      if (!extents.empty() &&
+          extents.back().offset + extents.back().length == aligned) {
+         extents.back().length += tail.length;
+      } else {
+         extents.push_back(tail);
+      }
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * IsZeroBuffer --
+ *
+ *      Checks whether a buffer only holds zeros, 128 bytes per step
+ *      with AVX2 or SSE2 where the compiler targets them.
+ *
+ * Results:
+ *      true if all len bytes are zero.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+IsZeroBuffer(const uint8 *buf,  // IN
+             size_t len)        // IN
+{
+   size_t i = 0;
+
+#if defined(__AVX2__)
+   for (; i + 128 <= len; i += 128) {
+      const __m256i *p = (const __m256i *)(buf + i);
+      __m256i v = _mm256_or_si256(
+         _mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1)),
+         _mm256_or_si256(_mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3)));
+
+      if (!_mm256_testz_si256(v, v)) {
+         return false;
+      }
+   }
+#elif defined(HAVE_SSE2)
+   for (; i + 128 <= len; i += 128) {
+      const __m128i *p = (const __m128i *)(buf + i);
+      __m128i v = _mm_or_si128(
+         _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+                      _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3))),
+         _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p + 4), _mm_loadu_si128(p + 5)),
+                      _mm_or_si128(_mm_loadu_si128(p + 6), _mm_loadu_si128(p + 7))));
+
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF) {
+         return false;
+      }
+   }
+#endif
+   for (; i < len; i++) {
+      if (buf[i] != 0) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+// CRC32C (Castagnoli) of copied chunks, with the SSE4.2 crc32
+// instruction where the CPU has it (checked at run time unless the
+// compiler targets SSE4.2 anyway), and else with tables for slicing by
+// 8 (which assume a little-endian CPU, as x86 and ARM are).
+// As crc32 has a latency of 3 cycles, large buffers are processed as 3
+// interleaved lanes of CRC32C_LANE bytes whose CRCs are then combined:
+// the CRC register is linear, so advancing a lane's CRC over the bytes
+// of the next lane is a lookup in the shift tables.
+
+#define CRC32C_POLY 0x82F63B78
+#define CRC32C_LANE 4096
+
+class Crc32cTables
+{
+public:
+    Crc32cTables()
+    {
+       uint32 i, j, k;
+
+       for (i = 0; i < 256; i++) {
+          uint32 crc = i;
+
+          for (j = 0; j < 8; j++) {
+             crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+          }
+          t[0][i] = crc;
+       }
+       for (i = 0; i < 256; i++) {
+          for (k = 1; k < 8; k++) {
+             t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+          }
+       }
+       hw = false;
+#ifdef HAVE_CRC32C_HW
+#ifdef CRC32C_DISPATCH
+       __builtin_cpu_init();
+       hw = __builtin_cpu_supports("sse4.2") != 0;
+#else
+       hw = true;
+#endif
+       uint32 bits[32];
+
+       for (j = 0; j < 32; j++) {
+          uint32 crc = 1U << j;
+
+          for (i = 0; i < CRC32C_LANE; i++) {
+             crc = t[0][crc & 0xFF] ^ (crc >> 8);
+          }
+          bits[j] = crc;
+       }
+       for (k = 0; k < 4; k++) {
+          for (i = 0; i < 256; i++) {
+             shift[k][i] = 0;
+             for (j = 0; j < 8; j++) {
+                if (i & (1 << j)) {
+                   shift[k][i] ^= bits[8 * k + j];
+                }
+             }
+          }
+       }
+#endif
+    }
+
+    // The CRC register advanced over CRC32C_LANE zero bytes.
+    uint32 Shift(uint32 crc) const
+    {
+       return shift[0][crc & 0xFF] ^ shift[1][(crc >> 8) & 0xFF] ^
+              shift[2][(crc >> 16) & 0xFF] ^ shift[3][crc >> 24];
+    }
+
+    uint32 t[8][256];
+    uint32 shift[4][256];
+    bool hw;                // use Crc32cHw
+};
+
+static Crc32cTables crc32cTables;
+
+
+#ifdef HAVE_CRC32C_HW
+/*
+ *----------------------------------------------------------------------
+ *
+ * Crc32cHw --
+ *
+ *      Advances a CRC32C register over a buffer with the SSE4.2 crc32
+ *      instruction.
+ *
+ * Results:
+ *      The new register value.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CRC32C_TARGET uint32
+Crc32cHw(uint32 crc,         // IN
+         const uint8 *buf,   // IN
+         size_t len)         // IN
+{
+#if defined(__x86_64__) || defined(_M_X64)
+   uint64 crc64 = crc;
+
+   for (; len >= 3 * CRC32C_LANE; buf += 3 * CRC32C_LANE,
+                                  len -= 3 * CRC32C_LANE) {
+      uint64 crc1 = 0, crc2 = 0;
+      size_t i;
+
+      for (i = 0; i < CRC32C_LANE; i += 8) {
+         uint64 v0, v1, v2;
+
+         memcpy(&v0, buf + i, 8);
+         memcpy(&v1, buf + CRC32C_LANE + i, 8);
+         memcpy(&v2, buf + 2 * CRC32C_LANE + i, 8);
+         crc64 = _mm_crc32_u64(crc64, v0);
+         crc1 = _mm_crc32_u64(crc1, v1);
+         crc2 = _mm_crc32_u64(crc2, v2);
+      }
+      crc64 = crc32cTables.Shift(crc32cTables.Shift((uint32)crc64) ^
+                                 (uint32)crc1) ^ (uint32)crc2;
+   }
+   for (; len >= 8; buf += 8, len -= 8) {
+      uint64 v;
+
+      memcpy(&v, buf, 8);
+      crc64 = _mm_crc32_u64(crc64, v);
+   }
+   crc = (uint32)crc64;
+#else
+   for (; len >= 4; buf += 4, len -= 4) {
+      uint32 v;
+
+      memcpy(&v, buf, 4);
+      crc = _mm_crc32_u32(crc, v);
+   }
+#endif
+   for (; len > 0; buf++, len--) {
+      crc = _mm_crc32_u8(crc, *buf);
+   }
+   return crc;
+}
+#endif
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Crc32c --
+ *
+ *      Computes the CRC32C of a buffer.
+ *
+ * Results:
+ *      The checksum.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint32
+Crc32c(const uint8 *buf,  // IN
+       size_t len)        // IN
+{
+   const uint32 (*t)[256] = crc32cTables.t;
+   uint32 crc = 0xFFFFFFFF;
+
+#ifdef HAVE_CRC32C_HW
+   if (crc32cTables.hw) {
+      return ~Crc32cHw(crc, buf, len);
+   }
+#endif
+   for (; len >= 8; buf += 8, len -= 8) {
+      uint64 v;
+
+      memcpy(&v, buf, 8);
+      v ^= crc;
+      crc = t[7][v & 0xFF] ^ t[6][(v >> 8) & 0xFF] ^
+            t[5][(v >> 16) & 0xFF] ^ t[4][(v >> 24) & 0xFF] ^
+            t[3][(v >> 32) & 0xFF] ^ t[2][(v >> 40) & 0xFF] ^
+            t[1][(v >> 48) & 0xFF] ^ t[0][v >> 56];
+   }
+   for (; len > 0; buf++, len--) {
+      crc = t[0][(crc ^ *buf) & 0xFF] ^ (crc >> 8);
+   }
+   return ~crc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WriteNonZero --
+ *
+ *      Writes the blocks of ZERO_BLOCK_SECTORS of a buffer that are not
+ *      all zeros, coalescing runs of non-zero blocks into one write.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Counts the elided blocks in stats; throws on write errors.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+WriteNonZero(VixDiskLibHandle dst,             // IN
+             VixDiskLibSectorType sector,      // IN
+             VixDiskLibSectorType numSectors,  // IN
+             const uint8 *buf,                 // IN
+             CopyStats *stats)                 // IN/OUT
+{
+   VixDiskLibSectorType off, run = 0;
+
+   for (off = 0; off < numSectors; off += ZERO_BLOCK_SECTORS) {
+      VixDiskLibSectorType len = std::min((VixDiskLibSectorType)ZERO_BLOCK_SECTORS,
+                                          numSectors - off);
+
+      if (IsZeroBuffer(buf + off * VIXDISKLIB_SECTOR_SIZE,
+                       len * VIXDISKLIB_SECTOR_SIZE)) {
+         if (run < off) {
+            rateLimiter.Acquire(off - run);
+            CHECK_AND_THROW(VixDiskLib_Write(dst, sector + run, off - run,
+                                             buf + run * VIXDISKLIB_SECTOR_SIZE));
+         }
+         run = off + len;
+         stats->zeroBlocks++;
+         stats->zeroSectors += len;
+      }
+   }
+   if (run < numSectors) {
+      rateLimiter.Acquire(numSectors - run);
+      CHECK_AND_THROW(VixDiskLib_Write(dst, sector + run, numSectors - run,
+                                       buf + run * VIXDISKLIB_SECTOR_SIZE));
+   }
+}
+
+
+// Persistent record of the granules of a -copy destination that have
+// been written, kept in a memory-mapped file next to it (path + ".ckpt")
+// so that -resume can skip them after a failed run. The file holds a
+// CheckpointHeader followed by one bit per granule. A written chunk is
+// only marked pending at first: about every CHECKPOINT_SYNC_NS the
+// writer flushes the destination and commits the marks made before the
+// flush to the bitmap, so that the bitmap never claims data that is not
+// yet durable.
+
+#define CHECKPOINT_MAGIC "VDCKPT01"
+#define CHECKPOINT_SYNC_NS 1000000000ULL
+
+struct CheckpointHeader {
+   char magic[8];
+   uint64 capacity;
+   uint64 granule;
+   uint64 numGranules;
+};
+
+class CopyCheckpoint
+{
+public:
+    // Creates a new, empty checkpoint, or with resume opens the existing
+    // one, which must describe the same capacity and granule.
+    CopyCheckpoint(const string &path,               // IN
+                   VixDiskLibSectorType capacity,    // IN
+                   VixDiskLibSectorType granule,     // IN
+                   bool resume)                      // IN
+       : _path(path),
+         _granule(granule),
+         _map(NULL),
+         _bits(NULL),
+         _lastSyncNs(GetTimeNs())
+    {
+       CheckpointHeader header;
+
+       memset(&header, 0, sizeof header);
+       memcpy(header.magic, CHECKPOINT_MAGIC, sizeof header.magic);
+       header.capacity = capacity;
+       header.granule = granule;
+       header.numGranules = (capacity + granule - 1) / granule;
+       _size = sizeof header + (size_t)(header.numGranules + 7) / 8;
+
+       if (!Map(resume)) {
+          printf("Error: Cannot %s checkpoint file %s.\n",
+                 resume ? "open" : "create", path.c_str());
+          THROW_ERROR(VIX_E_FILE_NOT_FOUND);
+       }
+       if (resume) {
+          if (memcmp(_map, &header, sizeof header) != 0) {
+             printf("Error: Checkpoint file %s does not match this copy.\n",
+                    path.c_str());
+             Unmap();
+             THROW_ERROR(VIX_E_INVALID_ARG);
+          }
+       } else {
+          memset(_map, 0, _size);
+          memcpy(_map, &header, sizeof header);
+       }
+       _bits = _map + sizeof header;
+    }
+
+    ~CopyCheckpoint()
+    {
+       if (_map != NULL) {
+          Unmap();
+       }
+    }
+
+    // Records that sectors [sector, sector + numSectors) were written,
+    // pending a flush of the destination. The range covers whole
+    // granules, except at the end of the disk.
+    void Mark(VixDiskLibSectorType sector,      // IN
+              VixDiskLibSectorType numSectors)  // IN
+    {
+       VixDiskLibBlock block = { sector, numSectors };
+
+       _lock.Lock();
+       _pending.push_back(block);
+       _lock.Unlock();
+    }
+
+    // Returns the number of pending marks, or with due only if it is
+    // time to commit them, and 0 otherwise.
+    size_t NumPending(bool due) // IN
+    {
+       size_t n;
+
+       _lock.Lock();
+       n = _pending.size();
+       if (due && GetTimeNs() - _lastSyncNs < CHECKPOINT_SYNC_NS) {
+          n = 0;
+       }
+       _lock.Unlock();
+       return n;
+    }
+
+    // Sets the bits of the first numMarks pending marks, which the
+    // caller made durable by flushing the destination after counting
+    // them, and syncs the bitmap.
+    void Commit(size_t numMarks) // IN
+    {
+       size_t i;
+
+       _lock.Lock();
+       for (i = 0; i < numMarks; i++) {
+          const VixDiskLibBlock &block = _pending[i];
+          uint64 g, end = (block.offset + block.length + _granule - 1) /
+                          _granule;
+
+          for (g = block.offset / _granule; g < end; g++) {
+             _bits[g / 8] |= (uint8)(1 << (g % 8));
+          }
+       }
+       _pending.erase(_pending.begin(), _pending.begin() + numMarks);
+       _lastSyncNs = GetTimeNs();
+       Sync(false);
+       _lock.Unlock();
+    }
+
+    // Removes the granules recorded as written from a list of extents.
+    void RemoveDone(vector<VixDiskLibBlock> &extents) // IN/OUT
+    {
+       vector<VixDiskLibBlock> todo;
+       size_t i;
+
+       for (i = 0; i < extents.size(); i++) {
+          VixDiskLibSectorType cur = extents[i].offset;
+          VixDiskLibSectorType end = cur + extents[i].length;
+
+          while (cur < end) {
+             uint64 g = cur / _granule;
+             VixDiskLibSectorType next = std::min(end, (g + 1) * _granule);
+
+             if (!(_bits[g / 8] & (1 << (g % 8)))) {
+                if (!todo.empty() &&
+                    todo.back().offset + todo.back().length == cur) {
+                   todo.back().length += next - cur;
+                } else {
+                   VixDiskLibBlock block = { cur, next - cur };
+
+                   todo.push_back(block);
+                }
+             }
+             cur = next;
+          }
+       }
+       extents.swap(todo);
+    }
+
+    // Deletes the checkpoint once the copy is complete.
+    void Remove()
+    {
+       Unmap();
+       remove(_path.c_str());
+    }
+
+private:
+    bool Map(bool resume) // IN
+    {
+#ifdef _WIN32
+       _file = CreateFileA(_path.c_str(), GENERIC_READ | GENERIC_WRITE, 0,
+                           NULL, resume ? OPEN_EXISTING : CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL, NULL);
+       if (_file == INVALID_HANDLE_VALUE) {
+          return false;
+       }
+       _mapping = CreateFileMappingA(_file, NULL, PAGE_READWRITE,
+                                     (DWORD)((uint64)_size >> 32),
+                                     (DWORD)_size, NULL);
+       if (_mapping != NULL) {
+          _map = (uint8 *)MapViewOfFile(_mapping, FILE_MAP_WRITE, 0, 0, _size);
+          if (_map != NULL) {
+             return true;
+          }
+          CloseHandle(_mapping);
+       }
+       CloseHandle(_file);
+       return false;
+#else
+       struct stat st;
+       void *p;
+
+       _fd = open(_path.c_str(), resume ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC,
+                  0644);
+       if (_fd < 0) {
+          return false;
+       }
+       if ((resume && (fstat(_fd, &st) != 0 || (size_t)st.st_size != _size)) ||
+           (!resume && ftruncate(_fd, _size) != 0)) {
+          close(_fd);
+          return false;
+       }
+       p = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+       if (p == MAP_FAILED) {
+          close(_fd);
+          return false;
+       }
+       _map = (uint8 *)p;
+       return true;
+#endif
+    }
+
+    void Sync(bool wait) // IN
+    {
+#ifdef _WIN32
+       FlushViewOfFile(_map, _size);
+       if (wait) {
+          FlushFileBuffers(_file);
+       }
+#else
+       msync(_map, _size, wait ? MS_SYNC : MS_ASYNC);
+#endif
+    }
+
+    void Unmap()
+    {
+       if (_map == NULL) {
+          return;
+       }
+       Sync(true);
+#ifdef _WIN32
+       UnmapViewOfFile(_map);
+       CloseHandle(_mapping);
+       CloseHandle(_file);
+#else
+       munmap(_map, _size);
+       close(_fd);
+#endif
+       _map = NULL;
+    }
+
+    string _path;
+    VixDiskLibSectorType _granule;
+    size_t _size;
+    uint8 *_map;
+    uint8 *_bits;
+    vector<VixDiskLibBlock> _pending;
+    uint64 _lastSyncNs;
+    Mutex _lock;
+#ifdef _WIN32
+    HANDLE _file;
+    HANDLE _mapping;
+#else
+    int _fd;
+#endif
+};
+
+
+// Checksums of the chunks of a copy, as written by -checksum and
+// checked by -verify: a text file of "sector numSectors crc32c" lines in
+// sector order. Record may be called from several threads.
+
+struct ChecksumEntry {
+   VixDiskLibSectorType sector;
+   VixDiskLibSectorType numSectors;
+   uint32 crc;
+
+   bool operator<(const ChecksumEntry &other) const
+   {
+      return sector < other.sector;
+   }
+};
+
+class ChecksumManifest
+{
+public:
+    void Record(VixDiskLibSectorType sector,      // IN
+                VixDiskLibSectorType numSectors,  // IN
+                const uint8 *buf)                 // IN
+    {
+       ChecksumEntry entry;
+
+       entry.sector = sector;
+       entry.numSectors = numSectors;
+       entry.crc = Crc32c(buf, numSectors * VIXDISKLIB_SECTOR_SIZE);
+       _lock.Lock();
+       _entries.push_back(entry);
+       _lock.Unlock();
+    }
+
+    const vector<ChecksumEntry> &Entries() const { return _entries; }
+
+    bool Save(const char *path); // IN
+    bool Load(const char *path); // IN
+
+private:
+    Mutex _lock;
+    vector<ChecksumEntry> _entries;
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ChecksumManifest::Save --
+ *
+ *      Writes the recorded checksums to a file.
+ *
+ * Results:
+ *      false if the file cannot be written.
+ *
+ * Side effects:
+ *      Sorts the entries.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+ChecksumManifest::Save(const char *path) // IN
+{
+   FILE *file = fopen(path, "w");
+   size_t i;
+   bool ok;
+
+   if (file == NULL) {
+      printf("Error: Cannot create checksum manifest %s.\n", path);
+      return false;
+   }
+   std::sort(_entries.begin(), _entries.end());
+   fprintf(file, "# CRC32C of each chunk: sector numSectors crc\n");
+   for (i = 0; i < _entries.size(); i++) {
+      fprintf(file, "%" FMT64 "u %" FMT64 "u %08x\n", _entries[i].sector,
+              _entries[i].numSectors, _entries[i].crc);
+   }
+   ok = !ferror(file);
+   if (fclose(file) != 0 || !ok) {
+      printf("Error: Cannot write checksum manifest %s.\n", path);
+      return false;
+   }
+   printf("Wrote %d chunk checksums to %s.\n", (uint32)_entries.size(), path);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ChecksumManifest::Load --
+ *
+ *      Reads the checksums written by Save.
+ *
+ * Results:
+ *      false if the file cannot be read or has an invalid line.
+ *
+ * Side effects:
+ *      Replaces the entries.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+ChecksumManifest::Load(const char *path) // IN
+{
+   FILE *file = fopen(path, "r");
+   char line[256];
+   unsigned lineNo = 0;
+
+   if (file == NULL) {
+      printf("Error: Cannot open checksum manifest %s.\n", path);
+      return false;
+   }
+   _entries.clear();
+   while (fgets(line, sizeof line, file) != NULL) {
+      ChecksumEntry entry;
+      char *p = line, *end;
+
+      lineNo++;
+      while (isspace((unsigned char)*p)) {
+         p++;
+      }
+      if (*p == '\0' || *p == '#') {
+         continue;
+      }
+      entry.sector = strtoull(p, &end, 10);
+      if (end != p) {
+         p = end;
+         entry.numSectors = strtoull(p, &end, 10);
+      }
+      if (end == p || entry.numSectors == 0) {
+         end = NULL;
+      } else {
+         p = end;
+         entry.crc = strtoul(p, &end, 16);
+      }
+      if (end != NULL && end != p) {
+         while (isspace((unsigned char)*end)) {
+            end++;
+         }
+         if (*end != '\0') {
+            end = NULL;
+         }
+      }
+      if (end == NULL || end == p) {
+         printf("Error: %s:%d: invalid checksum entry.\n", path, lineNo);
+         fclose(file);
+         return false;
+      }
+      _entries.push_back(entry);
+   }
+   fclose(file);
+   return true;
+}
+
+
+struct PipelineWorker {
+   class CopyPipeline *pipeline;
+   VixDiskLibHandle handle;
+   CopyStats stats;
+};
+
+// Copies a list of extents between disks with reader threads (one per
+// source handle) and writer threads (one per destination handle; as a
+// disk can only be opened for writing once, usually a single writer).
+// Readers claim chunks in order, fill a free buffer and hand it to the
+// writers through a lock-free ring; writers hand it back through
+// another. The depth buffers bound how far the readers run ahead, so a
+// slow side throttles the fast one instead of queueing without bound;
+// the waiting side sleeps in BoundedRing::Pop.
+// With skipZeros, which is only safe for a freshly created
+// destination, all-zero blocks of ZERO_BLOCK_SECTORS are not written.
+
+class CopyPipeline
+{
+public:
+    CopyPipeline(const vector<VixDiskLibHandle> &srcs,  // IN
+                 const vector<VixDiskLibHandle> &dsts,  // IN
+                 VixDiskLibSectorType chunkSectors,     // IN
+                 uint32 depth,                          // IN
+                 bool skipZeros)                        // IN
+       : _chunkSectors(chunkSectors),
+         _skipZeros(skipZeros),
+         _bufs(depth * chunkSectors * VIXDISKLIB_SECTOR_SIZE),
+         _free(BoundedRing<PipelineChunk>::CapacityFor(depth)),
+         _full(BoundedRing<PipelineChunk>::CapacityFor(depth)),
+         _checkpoint(NULL),
+         _manifest(NULL),
+         _extents(NULL),
+         _nextChunk(0),
+         _readersLeft(0),
+         _error(VIX_OK)
+    {
+       uint32 i;
+
+       memset(&_stats, 0, sizeof _stats);
+       for (i = 0; i < depth; i++) {
+          PipelineChunk chunk;
+
+          chunk.buf = _bufs.Get() + i * chunkSectors * VIXDISKLIB_SECTOR_SIZE;
+          _free.TryPush(chunk);
+       }
+       AddWorkers(srcs, _readers);
+       AddWorkers(dsts, _writers);
+    }
+
+    // Copies every extent of a list, as returned by QueryAllocatedExtents.
+    void Run(const vector<VixDiskLibBlock> &extents) // IN
+    {
+       vector<ThreadHandle> threads;
+       size_t i;
+
+       _extents = &extents;
+       _chunkStart.assign(1, 0);
+       for (i = 0; i < extents.size(); i++) {
+          _chunkStart.push_back(_chunkStart.back() +
+                                (extents[i].length + _chunkSectors - 1) /
+                                _chunkSectors);
+       }
+       _nextChunk.store(0);
+       _readersLeft.store((uint32)_readers.size());
+
+       _stats.startNs = GetTimeNs();
+       for (i = 0; i < _readers.size(); i++) {
+          threads.push_back(StartThread(&ReaderThread, &_readers[i]));
+       }
+       for (i = 0; i < _writers.size(); i++) {
+          threads.push_back(StartThread(&WriterThread, &_writers[i]));
+       }
+       for (i = 0; i < threads.size(); i++) {
+          JoinThread(threads[i]);
+       }
+       _stats.endNs = GetTimeNs();
+
+       for (i = 0; i < _writers.size(); i++) {
+          _stats.copiedSectors += _writers[i].stats.copiedSectors;
+          _stats.zeroSectors += _writers[i].stats.zeroSectors;
+          _stats.zeroBlocks += _writers[i].stats.zeroBlocks;
+       }
+       if (_error.load() != VIX_OK) {
+          throw VixDiskLibErrWrapper(_error.load(), __FILE__, __LINE__);
+       }
+    }
+
+    // Copied, zero and (as set by the caller) skipped sectors.
+    CopyStats &Stats() { return _stats; }
+
+    // Records every chunk in checkpoint once written and flushed. Only
+    // for a pipeline with a single destination.
+    void SetCheckpoint(CopyCheckpoint *checkpoint) { _checkpoint = checkpoint; }
+
+    // Records the checksum of every chunk read in manifest.
+    void SetManifest(ChecksumManifest *manifest) { _manifest = manifest; }
+
+private:
+    void AddWorkers(const vector<VixDiskLibHandle> &handles,  // IN
+                    vector<PipelineWorker> &workers)          // OUT
+    {
+       size_t i;
+
+       workers.resize(handles.size());
+       for (i = 0; i < handles.size(); i++) {
+          memset(&workers[i].stats, 0, sizeof workers[i].stats);
+          workers[i].pipeline = this;
+          workers[i].handle = handles[i];
+       }
+    }
+
+    // Records the first error and wakes up every stage to stop.
+    void Fail(VixError error)
+    {
+       VixError none = VIX_OK;
+
+       _error.compare_exchange_strong(none, error);
+       _free.Close();
+       _full.Close();
+    }
+
+    // Fills in the position of chunk n of the extent list.
+    bool ChunkAt(uint64 n,                // IN
+                 PipelineChunk *chunk)    // OUT
+    {
+       const vector<VixDiskLibBlock> &extents = *_extents;
+       size_t k;
+
+       if (n >= _chunkStart.back()) {
+          return false;
+       }
+       k = std::upper_bound(_chunkStart.begin(), _chunkStart.end(), n) -
+           _chunkStart.begin() - 1;
+       chunk->sector = extents[k].offset + (n - _chunkStart[k]) * _chunkSectors;
+       chunk->numSectors = std::min(_chunkSectors, extents[k].offset +
+                                    extents[k].length - chunk->sector);
+       return true;
+    }
+
+    static TaskResult TASK_CALL ReaderThread(void *arg)
+    {
+       PipelineWorker *worker = (PipelineWorker *)arg;
+       CopyPipeline *pipeline = worker->pipeline;
+       PipelineChunk chunk;
+
+       while (pipeline->_free.Pop(&chunk)) {
+          if (pipeline->_error.load() != VIX_OK) {
+             break;
+          }
+          if (!pipeline->ChunkAt(pipeline->_nextChunk++, &chunk)) {
+             pipeline->_free.TryPush(chunk);
+             break;
+          }
+
+          rateLimiter.Acquire(chunk.numSectors);
+          VixError vixError = VixDiskLib_Read(worker->handle, chunk.sector,
+                                              chunk.numSectors, chunk.buf);
+          if (VIX_FAILED(vixError)) {
+             pipeline->Fail(vixError);
+             break;
+          }
+          if (pipeline->_manifest != NULL) {
+             pipeline->_manifest->Record(chunk.sector, chunk.numSectors,
+                                         chunk.buf);
+          }
+          // Cannot fail: there are no more chunks than ring cells.
+          pipeline->_full.TryPush(chunk);
+       }
+       if (--pipeline->_readersLeft == 0) {
+          pipeline->_full.Close();
+       }
+       return TASK_OK;
+    }
+
+    static TaskResult TASK_CALL WriterThread(void *arg)
+    {
+       PipelineWorker *worker = (PipelineWorker *)arg;
+       CopyPipeline *pipeline = worker->pipeline;
+       CopyCheckpoint *checkpoint = pipeline->_checkpoint;
+       PipelineChunk chunk;
+       size_t numMarks;
+
+       while (pipeline->_full.Pop(&chunk)) {
+          if (pipeline->_error.load() != VIX_OK) {
+             break;
+          }
+          try {
+             if (pipeline->_skipZeros) {
+                WriteNonZero(worker->handle, chunk.sector, chunk.numSectors,
+                             chunk.buf, &worker->stats);
+             } else {
+                rateLimiter.Acquire(chunk.numSectors);
+                CHECK_AND_THROW(VixDiskLib_Write(worker->handle,
+                                                 chunk.sector,
+                                                 chunk.numSectors,
+                                                 chunk.buf));
+             }
+          } catch (const VixDiskLibErrWrapper& e) {
+             pipeline->Fail(e.ErrorCode());
+             break;
+          }
+          worker->stats.copiedSectors += chunk.numSectors;
+          if (checkpoint != NULL) {
+             checkpoint->Mark(chunk.sector, chunk.numSectors);
+             numMarks = checkpoint->NumPending(true);
+             if (numMarks != 0) {
+                VixError vixError = VixDiskLib_Flush(worker->handle);
+
+                if (VIX_FAILED(vixError)) {
+                   pipeline->Fail(vixError);
+                   break;
+                }
+                checkpoint->Commit(numMarks);
+             }
+          }
+          pipeline->_free.TryPush(chunk);
+       }
+
+       // Keep what was written for -resume, also if another stage failed.
+       if (checkpoint != NULL) {
+          numMarks = checkpoint->NumPending(false);
+          if (numMarks != 0 && VixDiskLib_Flush(worker->handle) == VIX_OK) {
+             checkpoint->Commit(numMarks);
+          }
+       }
+       return TASK_OK;
+    }
+
+    VixDiskLibSectorType _chunkSectors;
+    bool _skipZeros;
+    IoBuffer _bufs;
+    BoundedRing<PipelineChunk> _free;
+    BoundedRing<PipelineChunk> _full;
+    vector<PipelineWorker> _readers;
+    vector<PipelineWorker> _writers;
+    CopyCheckpoint *_checkpoint;
+    ChecksumManifest *_manifest;
+    const vector<VixDiskLibBlock> *_extents;
+    vector<uint64> _chunkStart;    // index of the first chunk of extent k
+    std::atomic<uint64> _nextChunk;
+    std::atomic<uint32> _readersLeft;
+    std::atomic<VixError> _error;
+    CopyStats _stats;
+};
+
+
+// One chunk of an ExtentCopier: read from the source into buf, then
+// written from buf to the destination.
+struct ExtentChunk {
+   class ExtentCopier *copier;
+   uint8 *buf;
+   VixDiskLibSectorType sector;
+   VixDiskLibSectorType numSectors;
+   bool writing;
+};
+
+// Copies a list of extents between two open disks with up to depth
+// chunks in flight, each chunk moving from an asynchronous read to an
+// asynchronous write. All requests are issued from the calling thread;
+// the completion callback only hands chunks back.
+
+class ExtentCopier
+{
+public:
+    ExtentCopier(VixDiskLibHandle src,                // IN
+                 VixDiskLibHandle dst,                // IN
+                 VixDiskLibSectorType chunkSectors,   // IN
+                 uint32 depth)                        // IN
+       : _src(src),
+         _dst(dst),
+         _chunkSectors(chunkSectors),
+         _bufs(depth * chunkSectors * VIXDISKLIB_SECTOR_SIZE),
+         _chunks(depth),
+         _manifest(NULL),
+         _inFlight(0),
+         _error(VIX_OK)
+    {
+       uint32 i;
+
+       memset(&_stats, 0, sizeof _stats);
+       for (i = 0; i < depth; i++) {
+          _chunks[i].copier = this;
+          _chunks[i].buf = _bufs.Get() +
+                           i * chunkSectors * VIXDISKLIB_SECTOR_SIZE;
+          _idle.push_back(&_chunks[i]);
+       }
+    }
+
+    void Copy(const vector<VixDiskLibBlock> &extents) // IN
+    {
+       size_t next = 0;
+       VixDiskLibSectorType done = 0;
+
+       _lock.Lock();
+       while (_inFlight != 0 || !_readDone.empty() ||
+              (_error == VIX_OK && next < extents.size())) {
+          ExtentChunk *chunk;
+
+          if (!_readDone.empty()) {
+             chunk = _readDone.back();
+             _readDone.pop_back();
+             _inFlight++;
+             _lock.Unlock();
+             if (_manifest != NULL) {
+                _manifest->Record(chunk->sector, chunk->numSectors,
+                                  chunk->buf);
+             }
+             chunk->writing = true;
+             Issue(chunk);
+             _lock.Lock();
+          } else if (_error == VIX_OK && next < extents.size() &&
+                     !_idle.empty()) {
+             const VixDiskLibBlock &extent = extents[next];
+
+             chunk = _idle.back();
+             _idle.pop_back();
+             _inFlight++;
+             _lock.Unlock();
+             chunk->sector = extent.offset + done;
+             chunk->numSectors = std::min(_chunkSectors,
+                                          extent.length - done);
+             chunk->writing = false;
+             done += chunk->numSectors;
+             if (done == extent.length) {
+                next++;
+                done = 0;
+             }
+             Issue(chunk);
+             _lock.Lock();
+          } else {
+             _cond.Wait(_lock);
+          }
+       }
+       _lock.Unlock();
+       VixDiskLib_Wait(_src);
+       VixDiskLib_Wait(_dst);
+       CHECK_AND_THROW(_error);
+    }
+
+    CopyStats &Stats() { return _stats; }
+
+    // Records the checksum of every chunk read in manifest.
+    void SetManifest(ChecksumManifest *manifest) { _manifest = manifest; }
+
+private:
+    void Issue(ExtentChunk *chunk) // IN
+    {
+       VixError vixError;
+
+       rateLimiter.Acquire(chunk->numSectors);
+       if (chunk->writing) {
+          vixError = VixDiskLib_WriteAsync(_dst, chunk->sector,
+                                           chunk->numSectors, chunk->buf,
+                                           Done, chunk);
+       } else {
+          vixError = VixDiskLib_ReadAsync(_src, chunk->sector,
+                                          chunk->numSectors, chunk->buf,
+                                          Done, chunk);
+       }
+       if (vixError != VIX_ASYNC) {
+          // Not queued, so the callback will not fire: complete it here.
+          Done(chunk, vixError);
+       }
+    }
+
+    static void Done(void *cbData,     // IN
+                     VixError result)  // IN
+    {
+       ExtentChunk *chunk = (ExtentChunk *)cbData;
+       ExtentCopier *copier = chunk->copier;
+
+       copier->_lock.Lock();
+       copier->_inFlight--;
+       if (VIX_FAILED(result)) {
+          if (copier->_error == VIX_OK) {
+             copier->_error = result;
+          }
+          copier->_idle.push_back(chunk);
+       } else if (chunk->writing) {
+          copier->_stats.copiedSectors += chunk->numSectors;
+          copier->_idle.push_back(chunk);
+       } else if (copier->_error == VIX_OK) {
+          copier->_readDone.push_back(chunk);
+       } else {
+          copier->_idle.push_back(chunk);
+       }
+       copier->_cond.Signal();
+       copier->_lock.Unlock();
+    }
+
+    VixDiskLibHandle _src;
+    VixDiskLibHandle _dst;
+    VixDiskLibSectorType _chunkSectors;
+    IoBuffer _bufs;
+    vector<ExtentChunk> _chunks;
+    ChecksumManifest *_manifest;
+    Mutex _lock;
+    CondVar _cond;
+    vector<ExtentChunk *> _idle;
+    vector<ExtentChunk *> _readDone;  // read, waiting to be written
+    uint32 _inFlight;
+    VixError _error;
+    CopyStats _stats;
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintCopyStat --
+ *
+ *      Print the throughput of a copy and the data it did not write.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrintCopyStat(const string &label,      // IN
+              const CopyStats &stats)   // IN
+{
+   double elapsed = std::max((stats.endNs - stats.startNs) / 1e9, 1e-9);
+
+   printf("%sCopied %d MBytes in %d msec (%d MBytes/sec)", label.c_str(),
+          (uint32)(stats.copiedSectors / 2048), (uint32)(elapsed * 1000),
+          (uint32)(stats.copiedSectors / 2048.0 / elapsed));
+   if (stats.skippedSectors != 0) {
+      printf(", skipped %d MBytes unallocated",
+             (uint32)(stats.skippedSectors / 2048));
+   }
+   if (stats.zeroBlocks != 0) {
+      printf(", elided %" FMT64 "u zero blocks (%d MBytes)", stats.zeroBlocks,
+             (uint32)(stats.zeroSectors / 2048));
+   }
+   printf("\n");
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyThread --
+ *
+ *       Copies the allocated extents of a source disk to the given
+ *       file, appGlobals.chunkMB MBytes at a time, leaving out blocks
+ *       of zeros. Reads and writes run on separate pipeline threads.
+ *
+ * Results:
+ *       0 if succeeded, 1 if not.
+ *
+ * Side effects:
+ *      Creates a new disk; sets appGlobals.success to false if fails
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TaskResult TASK_CALL
+CopyThread(void *arg)
+{
+   ThreadData *td = (ThreadData *)arg;
+
+    try {
+      CopyPipeline pipeline(vector<VixDiskLibHandle>(1, td->srcHandle),
+                            vector<VixDiskLibHandle>(1, td->dstHandle),
+                            appGlobals.chunkMB * 2048,
+                            appGlobals.pipelineDepth, true);
+
+      pipeline.Run(td->extents);
+      pipeline.Stats().skippedSectors = td->numSectors -
+                                        pipeline.Stats().copiedSectors;
+      td->stats = pipeline.Stats();
+    } catch (const VixDiskLibErrWrapper& e) {
+       cout << "CopyThread (" << td->dstDisk << ")Error: " << e.ErrorCode()
+            <<" " << e.Description();
+        appGlobals.success = FALSE;
+        return TASK_FAIL;
+    }
+
+    cout << "CopyThread to " << td->dstDisk << " succeeded.\n";
+    PrintCopyStat("   ", td->stats);
+    return TASK_OK;
+}
+
+
+// One chunk of a fan-out copy, shared by all writers: refs counts the
+// writers that have yet to write it.
+struct FanoutChunk {
+   VixDiskLibSectorType sector;
+   VixDiskLibSectorType numSectors;
+   uint8 *buf;
+   uint32 refs;
+};
+
+// Read-once copy to several destinations: the reader fills chunk k into
+// slot k % FANOUT_DEPTH once all writers are done with its previous
+// contents, and every writer writes chunks 0, 1, 2, ... to its own
+// destination.
+struct FanoutCopy {
+   Mutex lock;
+   CondVar cond;
+   vector<FanoutChunk> slots;
+   uint64 produced;     // chunks read so far
+   bool finished;       // no more chunks will be produced
+   bool failed;
+};
+
+struct FanoutWriter {
+   FanoutCopy *copy;
+   ThreadData *td;
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FanoutWriterThread --
+ *
+ *      Writes every chunk of a fan-out copy to one destination.
+ *
+ * Results:
+ *      0 if succeeded, 1 if not.
+ *
+ * Side effects:
+ *      Sets appGlobals.success to false if fails.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TaskResult TASK_CALL
+FanoutWriterThread(void *arg)
+{
+   FanoutWriter *writer = (FanoutWriter *)arg;
+   FanoutCopy *copy = writer->copy;
+   ThreadData *td = writer->td;
+   uint64 next = 0;
+
+   memset(&td->stats, 0, sizeof td->stats);
+   td->stats.startNs = GetTimeNs();
+   try {
+      for (;;) {
+         FanoutChunk *chunk;
+
+         copy->lock.Lock();
+         while (next == copy->produced && !copy->finished && !copy->failed) {
+            copy->cond.Wait(copy->lock);
+         }
+         if (copy->failed || next == copy->produced) {
+            copy->lock.Unlock();
+            break;
+         }
+         chunk = &copy->slots[next % copy->slots.size()];
+         copy->lock.Unlock();
+
+         WriteNonZero(td->dstHandle, chunk->sector, chunk->numSectors,
+                      chunk->buf, &td->stats);
+         td->stats.copiedSectors += chunk->numSectors;
+         next++;
+
+         copy->lock.Lock();
+         if (--chunk->refs == 0) {
+            copy->cond.Broadcast();
+         }
+         copy->lock.Unlock();
+      }
+   } catch (const VixDiskLibErrWrapper& e) {
+      cout << "FanoutWriterThread (" << td->dstDisk << ") Error: "
+           << e.ErrorCode() << " " << e.Description() << "\n";
+      copy->lock.Lock();
+      copy->failed = true;
+      copy->cond.Broadcast();
+      copy->lock.Unlock();
+      appGlobals.success = FALSE;
+      return TASK_FAIL;
+   }
+   td->stats.endNs = GetTimeNs();
+   td->stats.skippedSectors = td->numSectors - td->stats.copiedSectors;
+   return TASK_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoFanoutCopy --
+ *
+ *      Reads the allocated extents of the source disk of threadData[0]
+ *      once and writes them to the destinations of all threadData, one
+ *      writer thread per destination.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Sets appGlobals.success to false if fails.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DoFanoutCopy(vector<ThreadData> &threadData) // IN/OUT
+{
+   VixDiskLibSectorType chunkSectors = appGlobals.chunkMB * 2048;
+   const vector<VixDiskLibBlock> &extents = threadData[0].extents;
+   IoBuffer bufs(FANOUT_DEPTH * chunkSectors * VIXDISKLIB_SECTOR_SIZE);
+   vector<FanoutWriter> writers(threadData.size());
+   vector<ThreadHandle> threads(threadData.size());
+   VixDiskLibSectorType readSectors = 0;
+   FanoutCopy copy;
+   uint64 startNs = GetTimeNs();
+   bool failed = false;
+   size_t i, k;
+
+   copy.slots.resize(FANOUT_DEPTH);
+   for (i = 0; i < copy.slots.size(); i++) {
+      copy.slots[i].buf = bufs.Get() + i * chunkSectors * VIXDISKLIB_SECTOR_SIZE;
+      copy.slots[i].refs = 0;
+   }
+   copy.produced = 0;
+   copy.finished = false;
+   copy.failed = false;
+
+   for (i = 0; i < threadData.size(); i++) {
+      writers[i].copy = &copy;
+      writers[i].td = &threadData[i];
+      threads[i] = StartThread(&FanoutWriterThread, &writers[i]);
+   }
+
+   try {
+      for (k = 0; k < extents.size() && !failed; k++) {
+         VixDiskLibSectorType cur = extents[k].offset;
+         VixDiskLibSectorType end = cur + extents[k].length;
+
+         while (cur < end) {
+            FanoutChunk *chunk;
+            VixError vixError;
+
+            copy.lock.Lock();
+            chunk = &copy.slots[copy.produced % copy.slots.size()];
+            while (chunk->refs != 0 && !copy.failed) {
+               copy.cond.Wait(copy.lock);
+            }
+            failed = copy.failed;
+            copy.lock.Unlock();
+            if (failed) {
+               break;
+            }
+
+            chunk->sector = cur;
+            chunk->numSectors = std::min(chunkSectors, end - cur);
+            rateLimiter.Acquire(chunk->numSectors);
+            vixError = VixDiskLib_Read(threadData[0].srcHandle, chunk->sector,
+                                       chunk->numSectors, chunk->buf);
+            CHECK_AND_THROW(vixError);
+            cur += chunk->numSectors;
+            readSectors += chunk->numSectors;
+
+            copy.lock.Lock();
+            chunk->refs = (uint32)threadData.size();
+            copy.produced++;
+            copy.cond.Broadcast();
+            copy.lock.Unlock();
+         }
+      }
+   } catch (const VixDiskLibErrWrapper& e) {
+      cout << "DoFanoutCopy Error: " << e.ErrorCode() << " "
+           << e.Description() << "\n";
+      copy.lock.Lock();
+      copy.failed = true;
+      copy.lock.Unlock();
+      appGlobals.success = FALSE;
+   }
+
+   copy.lock.Lock();
+   copy.finished = true;
+   copy.cond.Broadcast();
+   copy.lock.Unlock();
+   for (i = 0; i < threads.size(); i++) {
+      JoinThread(threads[i]);
+   }
+
+   if (appGlobals.success) {
+      for (i = 0; i < threadData.size(); i++) {
+         cout << "Fan-out copy to " << threadData[i].dstDisk << " succeeded.\n";
+         PrintCopyStat("   ", threadData[i].stats);
+      }
+      printf("Read %d MBytes from the source once for %d copies in %d "
+             "msec.\n", (uint32)(readSectors / 2048),
+             (uint32)threadData.size(),
+             (uint32)((GetTimeNs() - startNs) / 1000000));
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrepareThreadData --
+ *
+ *      Open the source and destination disk for multi threaded copy.
+ *      If source is not NULL, td shares its source disk instead of
+ *      opening one (td.srcHandle is NULL).
+ *
+ * Results:
+ *      Fills in ThreadData in td.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrepareThreadData(VixDiskLibConnection &dstConnection,
+                  ThreadData &td,
+                  const ThreadData *source)  // IN: optional
+{
+   VixError vixError;
+   VixDiskLibCreateParams createParams;
+   VixDiskLibInfo *info = NULL;
+   string prefixName,randomFilename;
+
+#ifdef _WIN32
+   prefixName = "c:\\test";
+#else
+   prefixName = "/tmp/test";
+#endif
+   GenerateRandomFilename(prefixName, randomFilename);
+   td.dstDisk = randomFilename;
+
+   if (source != NULL) {
+      td.srcHandle = NULL;
+      td.numSectors = source->numSectors;
+      td.extents = source->extents;
+   } else {
+      vixError = VixDiskLib_Open(appGlobals.connection,
+                                 appGlobals.diskPath,
+                                 appGlobals.openFlags,
+                                 &td.srcHandle);
+      CHECK_AND_THROW(vixError);
+
+      vixError = VixDiskLib_GetInfo(td.srcHandle, &info);
+      CHECK_AND_THROW(vixError);
+      td.numSectors = info->capacity;
+      VixDiskLib_FreeInfo(info);
+
+      if (!QueryAllocatedExtents(td.srcHandle, td.numSectors, CopyGranule(),
+                                 td.extents)) {
+         printf("Allocation map of %s is not available, copying all "
+                "sectors.\n", appGlobals.diskPath);
+      }
+   }
+
+   createParams.adapterType = VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC;
+   createParams.capacity = td.numSectors;
+   createParams.diskType = VIXDISKLIB_DISK_SPLIT_SPARSE;
+   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+
+   vixError = VixDiskLib_Create(dstConnection, td.dstDisk.c_str(),
+                                &createParams, NULL, NULL);
+   CHECK_AND_THROW(vixError);
+
+   vixError = VixDiskLib_Open(dstConnection, td.dstDisk.c_str(), 0,
+                              &td.dstHandle);
+   CHECK_AND_THROW(vixError);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoTestMultiThread --
+ *
+ *      Starts a given number of threads, each of which will copy the
+ *      source disk to a temp. file. With -fanout, the source is read
+ *      once and the threads only write.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DoTestMultiThread(void)
+{
+   VixDiskLibConnectParams cnxParams = { 0 };
+   VixDiskLibConnection dstConnection;
+   VixError vixError;
+   vector<ThreadData> threadData(appGlobals.numThreads);
+   uint32 i;
+
+   vixError = VixDiskLib_Connect(&cnxParams, &dstConnection);
+   CHECK_AND_THROW(vixError);
+
+   vector<ThreadHandle> threads(appGlobals.numThreads);
+
+   if (appGlobals.fanout) {
+      for (i = 0; i < appGlobals.numThreads; i++) {
+         PrepareThreadData(dstConnection, threadData[i],
+                           i > 0 ? &threadData[0] : NULL);
+      }
+      DoFanoutCopy(threadData);
+   } else {
+      for (i = 0; i < appGlobals.numThreads; i++) {
+         PrepareThreadData(dstConnection, threadData[i], NULL);
+         threads[i] = StartThread(&CopyThread, (void*)&threadData[i]);
+      }
+      for (i = 0; i < appGlobals.numThreads; i++) {
+         JoinThread(threads[i]);
+      }
+   }
+   if (appGlobals.success) {
+      CopyStats total = threadData[0].stats;
+
+      for (i = 1; i < appGlobals.numThreads; i++) {
+         const CopyStats &stats = threadData[i].stats;
+
+         total.startNs = std::min(total.startNs, stats.startNs);
+         total.endNs = std::max(total.endNs, stats.endNs);
+         total.copiedSectors += stats.copiedSectors;
+         total.skippedSectors += stats.skippedSectors;
+         total.zeroSectors += stats.zeroSectors;
+         total.zeroBlocks += stats.zeroBlocks;
+      }
+      std::ostringstream label;
+      label << "Total (" << appGlobals.numThreads << " threads): ";
+      PrintCopyStat(label.str(), total);
+   }
+
+   for (i = 0; i < appGlobals.numThreads; i++) {
+      if (threadData[i].srcHandle != NULL) {
+         VixDiskLib_Close(threadData[i].srcHandle);
+      }
+      VixDiskLib_Close(threadData[i].dstHandle);
+      VixDiskLib_Unlink(dstConnection, threadData[i].dstDisk.c_str());
+   }
+   VixDiskLib_Disconnect(dstConnection);
+   if (!appGlobals.success) {
+      THROW_ERROR(VIX_E_FAIL);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CloneProgress --
+ *
+ *      Callback for the clone function.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+CloneProgressFunc(void * /*progressData*/,      // IN
+                  int percentCompleted)         // IN
+{
+   cout << "Cloning : " << percentCompleted << "% Done" << "\r";
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoClone --
+ *
+ *      Clones a local disk (possibly to an ESX host).
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DoClone(void)
+{
+   VixDiskLibConnection srcConnection;
+   VixDiskLibConnectParams cnxParams = { 0 };
+   VixError vixError = VixDiskLib_Connect(&cnxParams, &srcConnection);
+   CHECK_AND_THROW(vixError);
+
+   /*
+    *  Note : These createParams are ignored for remote case
+    */
+
+   VixDiskLibCreateParams createParams;
+   createParams.adapterType = appGlobals.adapterType;
+   createParams.capacity = appGlobals.mbSize * 2048;
+   createParams.diskType = VIXDISKLIB_DISK_MONOLITHIC_SPARSE;
+   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+
+   vixError = VixDiskLib_Clone(appGlobals.connection,
+                               appGlobals.diskPath,
+                               srcConnection,
+                               appGlobals.srcPath,
+                               &createParams,
+                               CloneProgressFunc,
+                               NULL,   // clientData
+                               TRUE);  // doOverWrite
+   VixDiskLib_Disconnect(srcConnection);
+   CHECK_AND_THROW(vixError);
+   cout << "\n Done" << "\n";
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ExtentLess --
+ *
+ *      Orders extents by offset.
+ *
+ * Results:
+ *      true if a starts before b.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ExtentLess(const VixDiskLibBlock &a,  // IN
+           const VixDiskLibBlock &b)  // IN
+{
+   return a.offset < b.offset;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseExtentFile --
+ *
+ *      Reads an extent list, one "offset length" pair per line, in
+ *      sectors or, with -extentunit bytes, in bytes as returned by
+ *      QueryChangedDiskAreas. Blank lines and lines starting with # are
+ *      ignored. The extents are sorted, and overlapping or adjacent
+ *      extents are coalesced.
+ *
+ * Results:
+ *      true if the file was parsed, byte extents are sector aligned and
+ *      all extents end at or before capacity.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ParseExtentFile(const char *path,                 // IN
+                VixDiskLibSectorType capacity,    // IN
+                vector<VixDiskLibBlock> &extents) // OUT
+{
+   FILE *file = fopen(path, "r");
+   vector<VixDiskLibBlock> list;
+   char line[256];
+   unsigned lineNo = 0;
+   size_t i;
+
+   if (file == NULL) {
+      printf("Error: Cannot open extent list %s.\n", path);
+      return false;
+   }
+   while (fgets(line, sizeof line, file) != NULL) {
+      VixDiskLibBlock extent;
+      char *p = line, *end;
+
+      lineNo++;
+      while (isspace((unsigned char)*p)) {
+         p++;
+      }
+      if (*p == '\0' || *p == '#') {
+         continue;
+      }
+      extent.offset = strtoull(p, &end, 0);
+      p = end;
+      while (isspace((unsigned char)*p) || *p == ',') {
+         p++;
+      }
+      extent.length = strtoull(p, &end, 0);
+      if (appGlobals.extentBytes && end != p) {
+         if (extent.offset % VIXDISKLIB_SECTOR_SIZE != 0 ||
+             extent.length % VIXDISKLIB_SECTOR_SIZE != 0) {
+            printf("Error: %s:%d: extent is not aligned to %d bytes.\n",
+                   path, lineNo, VIXDISKLIB_SECTOR_SIZE);
+            fclose(file);
+            return false;
+         }
+         extent.offset /= VIXDISKLIB_SECTOR_SIZE;
+         extent.length /= VIXDISKLIB_SECTOR_SIZE;
+      }
+      if (end == p || extent.length == 0 || extent.offset >= capacity ||
+          extent.length > capacity - extent.offset) {
+         printf("Error: %s:%d: invalid extent.\n", path, lineNo);
+         fclose(file);
+         return false;
+      }
+      list.push_back(extent);
+   }
+   fclose(file);
+
+   std::sort(list.begin(), list.end(), ExtentLess);
+   extents.clear();
+   for (i = 0; i < list.size(); i++) {
+      if (!extents.empty() &&
+          list[i].offset <= extents.back().offset + extents.back().length) {
+         VixDiskLibSectorType end = list[i].offset + list[i].length;
+
+         extents.back().length = std::max(extents.back().offset +
+                                          extents.back().length, end) -
+                                 extents.back().offset;
+      } else {
+         extents.push_back(list[i]);
+      }
+   }
+   printf("%d extents in %s, %d after coalescing.\n", (uint32)list.size(),
+          path, (uint32)extents.size());
+   return true;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * CopyNewDisk --
+ *
+ *      Creates the destination disk and copies the allocated, non-zero
+ *      data of an open source disk into it, with appGlobals.numReaders
+ *      reader threads (the others open their own source handle) and one
+ *      writer thread, recording chunk checksums in manifest if given.
+ *      Progress is kept in a CopyCheckpoint; with -resume, the
+ *      destination of a failed run is completed instead.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Creates a new disk, and its checkpoint file until the copy is
+ *      complete.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+CopyNewDisk(VixDiskLibConnection srcConnection,          // IN
+            VixDiskLibHandle srcHandle,                  // IN
+            const VixDiskLibCreateParams *createParams,  // IN
+            ChecksumManifest *manifest)                  // OUT: may be NULL
+{
+   VixDiskLibSectorType granule = CopyGranule();
+   VixDiskLibSectorType allocated = 0;
+   vector<VixDiskLibBlock> extents;
+   vector<VixDiskLibHandle> srcs(1, srcHandle);
+   VixError vixError;
+   size_t i;
+
+   if (!appGlobals.resume) {
+      vixError = VixDiskLib_Create(appGlobals.connection, appGlobals.diskPath,
+                                   createParams, NULL, NULL);
+      CHECK_AND_THROW(vixError);
+   }
+   VixDisk dst(appGlobals.connection, appGlobals.diskPath, 0);
+   CopyCheckpoint checkpoint(string(appGlobals.diskPath) + ".ckpt",
+                             createParams->capacity, granule,
+                             appGlobals.resume != 0);
+
+   if (!QueryAllocatedExtents(srcHandle, createParams->capacity, granule,
+                              extents)) {
+      printf("Allocation map of %s is not available, copying all "
+             "sectors.\n", appGlobals.srcPath);
+   }
+   for (i = 0; i < extents.size(); i++) {
+      allocated += extents[i].length;
+   }
+   if (appGlobals.resume) {
+      VixDiskLibSectorType todo = 0;
+
+      checkpoint.RemoveDone(extents);
+      for (i = 0; i < extents.size(); i++) {
+         todo += extents[i].length;
+      }
+      printf("Resuming: %d of %d MBytes already copied.\n",
+             (uint32)((allocated - todo) / 2048), (uint32)(allocated / 2048));
+   }
+
+   try {
+      while (srcs.size() < appGlobals.numReaders) {
+         VixDiskLibHandle handle;
+
+         vixError = VixDiskLib_Open(srcConnection, appGlobals.srcPath,
+                                    VIXDISKLIB_FLAG_OPEN_READ_ONLY, &handle);
+         CHECK_AND_THROW(vixError);
+         srcs.push_back(handle);
+      }
+
+      CopyPipeline pipeline(srcs, vector<VixDiskLibHandle>(1, dst.Handle()),
+                            appGlobals.chunkMB * 2048,
+                            appGlobals.pipelineDepth, true);
+      pipeline.SetCheckpoint(&checkpoint);
+      pipeline.SetManifest(manifest);
+      pipeline.Run(extents);
+      pipeline.Stats().skippedSectors = createParams->capacity - allocated;
+      PrintCopyStat("", pipeline.Stats());
+   } catch (const VixDiskLibErrWrapper &) {
+      for (i = 1; i < srcs.size(); i++) {
+         VixDiskLib_Close(srcs[i]);
+      }
+      throw;
+   }
+   for (i = 1; i < srcs.size(); i++) {
+      VixDiskLib_Close(srcs[i]);
+   }
+   checkpoint.Remove();
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * CopyChangedExtents --
+ *
+ *      Copies the extents listed in appGlobals.extentFile from an open
+ *      source disk into the existing destination disk, recording chunk
+ *      checksums in manifest if given.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Writes to the destination disk.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+CopyChangedExtents(VixDiskLibHandle srcHandle,        // IN
+                   VixDiskLibSectorType srcCapacity,  // IN
+                   ChecksumManifest *manifest)        // OUT: may be NULL
+{
+   VixDisk dst(appGlobals.connection, appGlobals.diskPath, 0);
+   vector<VixDiskLibBlock> extents;
+   VixDiskLibSectorType capacity;
+   VixDiskLibInfo *info;
+   VixError vixError;
+
+   vixError = VixDiskLib_GetInfo(dst.Handle(), &info);
+   CHECK_AND_THROW(vixError);
+   capacity = std::min(srcCapacity, info->capacity);
+   VixDiskLib_FreeInfo(info);
+
+   if (!ParseExtentFile(appGlobals.extentFile, capacity, extents)) {
+      THROW_ERROR(VIX_E_INVALID_ARG);
+   }
+
+   ExtentCopier copier(srcHandle, dst.Handle(), appGlobals.chunkMB * 2048,
+                       appGlobals.qdMin != 0 ? appGlobals.qdMin
+                                             : DEFAULT_EXTENT_QD);
+   copier.SetManifest(manifest);
+   copier.Stats().startNs = GetTimeNs();
+   copier.Copy(extents);
+   copier.Stats().endNs = GetTimeNs();
+   PrintCopyStat("", copier.Stats());
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoCopy --
+ *
+ *      Clones a local source disk through the copy pipeline instead of
+ *      VixDiskLib_Clone: creates the destination disk, then copies the
+ *      allocated, non-zero data of the source into it. With -extents,
+ *      updates an existing destination with the listed extents only.
+ *      With -checksum, also saves the checksums of the copied chunks.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Creates a new disk, or writes to an existing one.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoCopy(void)
+{
+   VixDiskLibConnection srcConnection;
+   VixDiskLibConnectParams cnxParams = { 0 };
+   VixDiskLibCreateParams createParams;
+   VixDiskLibInfo *info;
+   ChecksumManifest manifest;
+   ChecksumManifest *checksums = appGlobals.checksumFile != NULL ? &manifest
+                                                                 : NULL;
+   VixError vixError;
+
+   vixError = VixDiskLib_Connect(&cnxParams, &srcConnection);
+   CHECK_AND_THROW(vixError);
+
+   try {
+      VixDisk src(srcConnection, appGlobals.srcPath,
+                  VIXDISKLIB_FLAG_OPEN_READ_ONLY);
+
+      vixError = VixDiskLib_GetInfo(src.Handle(), &info);
+      CHECK_AND_THROW(vixError);
+      createParams.adapterType = appGlobals.adapterType;
+      createParams.capacity = info->capacity;
+      createParams.diskType = VIXDISKLIB_DISK_MONOLITHIC_SPARSE;
+      createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+      VixDiskLib_FreeInfo(info);
+
+      if (appGlobals.extentFile != NULL) {
+         CopyChangedExtents(src.Handle(), createParams.capacity, checksums);
+      } else {
+         CopyNewDisk(srcConnection, src.Handle(), &createParams, checksums);
+      }
+   } catch (const VixDiskLibErrWrapper &) {
+      VixDiskLib_Disconnect(srcConnection);
+      throw;
+   }
+   VixDiskLib_Disconnect(srcConnection);
+   if (checksums != NULL && !manifest.Save(appGlobals.checksumFile)) {
+      THROW_ERROR(VIX_E_FAIL);
+   }
+}
+
+
+// Called by RunDiskThreads with the first handle and the capacity of the
+// disk, before the threads start.
+typedef void (*ReaderSetupFunc)(VixDiskLibHandle handle,       // IN
+                                VixDiskLibSectorType capacity, // IN
+                                void *data);                   // IN/OUT
+
+// A thread of RunDiskThreads, with its own handle of a disk.
+struct DiskThread {
+   const char *path;
+   uint32 openFlags;
+   size_t bufSize;                      // bytes of its I/O buffer
+   VixDiskLibHandle *handle;            // OUT
+   VixDiskLibSectorType *capacity;      // OUT: optional
+   void *arg;                           // IN/OUT: of the thread function
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RunDiskThreads --
+ *
+ *      Opens the disk handle of every thread and runs func on one thread
+ *      per handle. If the first thread wants the capacity, it is read
+ *      from the first handle, and setup, if not NULL, is called with it
+ *      before the threads start. The I/O buffer of every thread is
+ *      reserved in the pool up front.
+ *
+ * Results:
+ *      The error of opening a disk or reading its capacity.
+ *
+ * Side effects:
+ *      The handles are closed again on return. elapsedNs, if not NULL,
+ *      receives the time the threads ran.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VixError
+RunDiskThreads(const vector<DiskThread> &threads, // IN
+               TaskFunc func,                     // IN
+               ReaderSetupFunc setup,             // IN: optional
+               void *setupData,                   // IN/OUT
+               uint64 *elapsedNs)                 // OUT: optional
+{
+   vector<ThreadHandle> running;
+   vector<size_t> bufSizes(threads.size());
+   VixDiskLibInfo *info;
+   VixError vixError = VIX_OK;
+   uint64 startNs;
+   size_t i;
+
+   if (elapsedNs != NULL) {
+      *elapsedNs = 0;
+   }
+   for (i = 0; i < threads.size(); i++) {
+      *threads[i].handle = NULL;
+      bufSizes[i] = threads[i].bufSize;
+   }
+   bufferPool.Reserve(bufSizes);
+   // VixDiskLib_Open is not reentrant, so open all handles up front.
+   for (i = 0; i < threads.size() && VIX_SUCCEEDED(vixError); i++) {
+      vixError = VixDiskLib_Open(appGlobals.connection, threads[i].path,
+                                 threads[i].openFlags, threads[i].handle);
+   }
+   if (VIX_SUCCEEDED(vixError) && !threads.empty() &&
+       threads[0].capacity != NULL) {
+      vixError = VixDiskLib_GetInfo(*threads[0].handle, &info);
+      if (VIX_SUCCEEDED(vixError)) {
+         for (i = 0; i < threads.size(); i++) {
+            if (threads[i].capacity != NULL) {
+               *threads[i].capacity = info->capacity;
+            }
+         }
+         VixDiskLib_FreeInfo(info);
+         if (setup != NULL) {
+            setup(*threads[0].handle, *threads[0].capacity, setupData);
+         }
+      }
+   }
+   if (VIX_SUCCEEDED(vixError)) {
+      startNs = GetTimeNs();
+      for (i = 0; i < threads.size(); i++) {
+         running.push_back(StartThread(func, threads[i].arg));
+      }
+      for (i = 0; i < running.size(); i++) {
+         JoinThread(running[i]);
+      }
+      if (elapsedNs != NULL) {
+         *elapsedNs = GetTimeNs() - startNs;
+      }
+   }
+   for (i = 0; i < threads.size(); i++) {
+      if (*threads[i].handle != NULL) {
+         VixDiskLib_Close(*threads[i].handle);
+      }
+   }
+   return vixError;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RunReaders --
+ *
+ *      Runs func with RunDiskThreads on a read-only handle of a disk for
+ *      every thread data. The thread data type has handle, capacity and
+ *      error members; every thread gets a bufSize byte I/O buffer.
+ *
+ * Results:
+ *      The first error of opening the disk or of a thread.
+ *
+ * Side effects:
+ *      Sets the capacity and error of every thread data. See
+ *      RunDiskThreads for setup and elapsedNs.
+ *
+ *----------------------------------------------------------------------
+ */
+
+template <typename T>
+static VixError
+RunReaders(const char *path,        // IN
+           vector<T> &threadData,   // IN/OUT
+           TaskFunc func,           // IN
+           size_t bufSize,          // IN
+           ReaderSetupFunc setup,   // IN: optional
+           void *setupData,         // IN/OUT
+           uint64 *elapsedNs)       // OUT: optional
+{
+   vector<DiskThread> threads(threadData.size());
+   VixError vixError;
+   size_t i;
+
+   for (i = 0; i < threadData.size(); i++) {
+      threadData[i].capacity = 0;
+      threadData[i].error = VIX_OK;
+      threads[i].path = path;
+      threads[i].openFlags = appGlobals.openFlags |
+                             VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+      threads[i].bufSize = bufSize;
+      threads[i].handle = &threadData[i].handle;
+      threads[i].capacity = &threadData[i].capacity;
+      threads[i].arg = &threadData[i];
+   }
+   vixError = RunDiskThreads(threads, func, setup, setupData, elapsedNs);
+   for (i = 0; i < threadData.size(); i++) {
+      if (vixError == VIX_OK) {
+         vixError = threadData[i].error;
+      }
+   }
+   return vixError;
+}
+
+
+// State of one -verify thread.
+struct VerifyThreadData {
+   const vector<ChecksumEntry> *entries;
+   std::atomic<size_t> *next;
+   VixDiskLibHandle handle;
+   VixDiskLibSectorType capacity;
+   VixDiskLibSectorType maxSectors;
+   VixDiskLibSectorType sectors;
+   vector<VixDiskLibBlock> mismatches;
+   VixError error;
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VerifyThread --
+ *
+ *      Body of a -verify thread: claims manifest entries in order, reads
+ *      them and compares their checksum.
+ *
+ * Results:
+ *      TASK_OK.
+ *
+ * Side effects:
+ *      Fills in the sectors, mismatches and error of its thread data.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TaskResult TASK_CALL
+VerifyThread(void *arg) // IN
+{
+   VerifyThreadData *td = (VerifyThreadData *)arg;
+   IoBuffer buf(td->maxSectors * VIXDISKLIB_SECTOR_SIZE);
+   size_t i;
+
+   while ((i = (*td->next)++) < td->entries->size()) {
+      const ChecksumEntry &entry = (*td->entries)[i];
+
+      rateLimiter.Acquire(entry.numSectors);
+      td->error = VixDiskLib_Read(td->handle, entry.sector, entry.numSectors,
+                                  buf.Get());
+      if (VIX_FAILED(td->error)) {
+         break;
+      }
+      td->sectors += entry.numSectors;
+      if (Crc32c(buf.Get(), entry.numSectors * VIXDISKLIB_SECTOR_SIZE) !=
+          entry.crc) {
+         VixDiskLibBlock bad;
+
+         bad.offset = entry.sector;
+         bad.length = entry.numSectors;
+         td->mismatches.push_back(bad);
+      }
+   }
+   return TASK_OK;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoVerify --
+ *
+ *      Re-reads the chunks listed in a -checksum manifest from the disk,
+ *      with appGlobals.numReaders threads each on its own handle, and
+ *      reports the extents whose checksum differs.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Throws if any chunk does not match.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoVerify(void)
+{
+   ChecksumManifest manifest;
+   vector<VerifyThreadData> threadData(appGlobals.numReaders);
+   vector<VixDiskLibBlock> mismatches;
+   std::atomic<size_t> next(0);
+   VixDiskLibSectorType maxSectors = 0, sectors = 0;
+   VixError vixError;
+   uint64 elapsedNs;
+   size_t i, j;
+
+   if (!manifest.Load(appGlobals.verifyFile)) {
+      THROW_ERROR(VIX_E_INVALID_ARG);
+   }
+   for (i = 0; i < manifest.Entries().size(); i++) {
+      maxSectors = std::max(maxSectors, manifest.Entries()[i].numSectors);
+   }
+   for (i = 0; i < threadData.size(); i++) {
+      VerifyThreadData &td = threadData[i];
+
+      td.entries = &manifest.Entries();
+      td.next = &next;
+      td.maxSectors = maxSectors;
+      td.sectors = 0;
+   }
+   vixError = RunReaders(appGlobals.diskPath, threadData, &VerifyThread,
+                         maxSectors * VIXDISKLIB_SECTOR_SIZE, NULL, NULL,
+                         &elapsedNs);
+   for (i = 0; i < threadData.size(); i++) {
+      VerifyThreadData &td = threadData[i];
+
+      sectors += td.sectors;
+      mismatches.insert(mismatches.end(), td.mismatches.begin(),
+                        td.mismatches.end());
+   }
+   CHECK_AND_THROW(vixError);
+
+   // Report adjacent bad chunks as one extent.
+   std::sort(mismatches.begin(), mismatches.end(), ExtentLess);
+   for (i = 0; i < mismatches.size(); i = j) {
+      VixDiskLibSectorType end = mismatches[i].offset + mismatches[i].length;
+
+      for (j = i + 1;
+           j < mismatches.size() && mismatches[j].offset == end; j++) {
+         end += mismatches[j].length;
+      }
+      printf("Mismatch: sectors %" FMT64 "u-%" FMT64 "u\n", mismatches[i].offset,
+             end - 1);
+   }
+   printf("Verified %d chunks, %d MBytes in %d msec (%d MBytes/sec): %d "
+          "mismatched.\n", (uint32)manifest.Entries().size(),
+          (uint32)(sectors / 2048), (uint32)(elapsedNs / 1000000),
+          (uint32)(sectors * VIXDISKLIB_SECTOR_SIZE * 1e3 /
+                   (1024 * 1024) / std::max(elapsedNs / 1e6, 1e-3)),
+          (uint32)mismatches.size());
+   if (!mismatches.empty()) {
+      THROW_ERROR(VIX_E_FAIL);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Hash64 --
+ *
+ *      Computes the 64-bit xxHash (XXH64) of a buffer.
+ *
+ * Results:
+ *      The hash.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64
+HashRotl(uint64 x, int r)
+{
+   return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64
+HashRound(uint64 acc, uint64 input)
+{
+   return HashRotl(acc + input * XXH_PRIME64_2, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64
+HashMerge(uint64 acc, uint64 val)
+{
+   return (acc ^ HashRound(0, val)) * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64
+Hash64(const uint8 *buf,  // IN
+       size_t len,        // IN
+       uint64 seed)       // IN
+{
+   const uint8 *end = buf + len;
+   uint64 h;
+
+   if (len >= 32) {
+      uint64 v[4] = { seed + XXH_PRIME64_1 + XXH_PRIME64_2,
+                      seed + XXH_PRIME64_2, seed, seed - XXH_PRIME64_1 };
+      int i;
+
+      for (; end - buf >= 32; buf += 32) {
+         for (i = 0; i < 4; i++) {
+            uint64 lane;
+
+            memcpy(&lane, buf + 8 * i, 8);
+            v[i] = HashRound(v[i], lane);
+         }
+      }
+      h = HashRotl(v[0], 1) + HashRotl(v[1], 7) + HashRotl(v[2], 12) +
+          HashRotl(v[3], 18);
+      for (i = 0; i < 4; i++) {
+         h = HashMerge(h, v[i]);
+      }
+   } else {
+      h = seed + XXH_PRIME64_5;
+   }
+   h += len;
+   for (; end - buf >= 8; buf += 8) {
+      uint64 lane;
+
+      memcpy(&lane, buf, 8);
+      h = HashRotl(h ^ HashRound(0, lane), 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+   }
+   if (end - buf >= 4) {
+      uint32 lane;
+
+      memcpy(&lane, buf, 4);
+      h = HashRotl(h ^ (lane * XXH_PRIME64_1), 23) * XXH_PRIME64_2 +
+          XXH_PRIME64_3;
+      buf += 4;
+   }
+   for (; buf < end; buf++) {
+      h = HashRotl(h ^ (*buf * XXH_PRIME64_5), 11) * XXH_PRIME64_1;
+   }
+   h ^= h >> 33;
+   h *= XXH_PRIME64_2;
+   h ^= h >> 29;
+   h *= XXH_PRIME64_3;
+   h ^= h >> 32;
+   return h;
+}
+
+
+// Binary hash tree of a disk, for -digest and -diff. The leaves are the
+// Hash64 of the disk's chunks (of -chunk MBytes) and every other node is
+// the Hash64 of its one or two children, level by level in one array. A
+// digest file holds a MerkleHeader followed by that array.
+// Two trees of the same shape are compared from the root down, visiting
+// only the subtrees whose hashes differ.
+
+#define MERKLE_MAGIC "VDMERKL1"
+
+struct MerkleHeader {
+   char magic[8];
+   uint64 capacity;
+   uint64 chunkSectors;
+   uint64 numLeaves;
+};
+
+class MerkleTree
+{
+public:
+    MerkleTree() { memset(&_header, 0, sizeof _header); }
+
+    static bool IsDigestFile(const char *path); // IN
+
+    void Build(const char *path,                   // IN
+               VixDiskLibSectorType chunkSectors); // IN
+    bool Save(const char *path) const;             // IN
+    bool Load(const char *path);                   // IN
+
+    // Appends the extents where other differs to extents, and returns
+    // the number of nodes compared.
+    uint64 Diff(const MerkleTree &other,              // IN
+                vector<VixDiskLibBlock> &extents)     // OUT
+       const
+    {
+       uint64 visited = 0;
+
+       if (!_nodes.empty()) {
+          DiffNode(other, _levelStart.size() - 2, 0, extents, &visited);
+       }
+       return visited;
+    }
+
+    bool SameShape(const MerkleTree &other) const
+    {
+       return _header.capacity == other._header.capacity &&
+              _header.chunkSectors == other._header.chunkSectors;
+    }
+
+    uint64 Root() const { return _nodes.empty() ? 0 : _nodes.back(); }
+    uint64 NumNodes() const { return _nodes.size(); }
+    VixDiskLibSectorType ChunkSectors() const { return _header.chunkSectors; }
+
+private:
+    struct BuildThreadData {
+       MerkleTree *tree;
+       VixDiskLibHandle handle;
+       VixDiskLibSectorType capacity;
+       std::atomic<uint64> *next;
+       VixError error;
+    };
+
+    static TaskResult TASK_CALL BuildThread(void *arg);
+
+    // RunReaders setup of Build: sizes the tree for the disk.
+    static void BuildSetup(VixDiskLibHandle /* handle */, // IN
+                           VixDiskLibSectorType capacity, // IN
+                           void *data)                    // IN/OUT
+    {
+       MerkleTree *tree = (MerkleTree *)data;
+
+       tree->Init(capacity, tree->_header.chunkSectors);
+    }
+
+    void Init(VixDiskLibSectorType capacity,      // IN
+              VixDiskLibSectorType chunkSectors)  // IN
+    {
+       uint64 n;
+
+       memcpy(_header.magic, MERKLE_MAGIC, sizeof _header.magic);
+       _header.capacity = capacity;
+       _header.chunkSectors = chunkSectors;
+       _header.numLeaves = LeafCount(capacity, chunkSectors);
+       _levelStart.assign(1, 0);
+       for (n = _header.numLeaves; ; n = (n + 1) / 2) {
+          _levelStart.push_back(_levelStart.back() + n);
+          if (n <= 1) {
+             break;
+          }
+       }
+       _nodes.resize(_levelStart.back());
+    }
+
+    // Number of chunks of a disk, without overflow for any capacity.
+    static uint64 LeafCount(VixDiskLibSectorType capacity,      // IN
+                            VixDiskLibSectorType chunkSectors)  // IN
+    {
+       return capacity / chunkSectors + (capacity % chunkSectors != 0);
+    }
+
+    // Number of nodes of a tree with numLeaves leaves.
+    static uint64 NodeCount(uint64 numLeaves) // IN
+    {
+       uint64 count = 0, n;
+
+       for (n = numLeaves; ; n = (n + 1) / 2) {
+          count += n;
+          if (n <= 1) {
+             break;
+          }
+       }
+       return count;
+    }
+
+    // Number of nodes of a level.
+    uint64 LevelSize(size_t level) const
+    {
+       return _levelStart[level + 1] - _levelStart[level];
+    }
+
+    void HashLevels()
+    {
+       size_t level;
+       uint64 i;
+
+       for (level = 1; level + 1 < _levelStart.size(); level++) {
+          const uint64 *children = &_nodes[_levelStart[level - 1]];
+          uint64 numChildren = LevelSize(level - 1);
+
+          for (i = 0; i < LevelSize(level); i++) {
+             _nodes[_levelStart[level] + i] =
+                Hash64((const uint8 *)&children[2 * i],
+                       (2 * i + 1 < numChildren ? 2 : 1) * sizeof(uint64), 0);
+          }
+       }
+    }
+
+    void DiffNode(const MerkleTree &other,            // IN
+                  size_t level,                       // IN
+                  uint64 index,                       // IN
+                  vector<VixDiskLibBlock> &extents,   // OUT
+                  uint64 *visited) const              // IN/OUT
+    {
+       uint64 node = _levelStart[level] + index;
+
+       ++*visited;
+       if (_nodes[node] == other._nodes[node]) {
+          return;
+       }
+       if (level == 0) {
+          VixDiskLibBlock extent;
+
+          extent.offset = index * _header.chunkSectors;
+          extent.length = std::min(_header.chunkSectors,
+                                   _header.capacity - extent.offset);
+          if (!extents.empty() &&
+              extents.back().offset + extents.back().length ==
+              extent.offset) {
+             extents.back().length += extent.length;
+          } else {
+             extents.push_back(extent);
+          }
+          return;
+       }
+       DiffNode(other, level - 1, 2 * index, extents, visited);
+       if (2 * index + 1 < LevelSize(level - 1)) {
+          DiffNode(other, level - 1, 2 * index + 1, extents, visited);
+       }
+    }
+
+    MerkleHeader _header;
+    vector<uint64> _levelStart;  // index of the first node of each level
+    vector<uint64> _nodes;
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MerkleTree::IsDigestFile --
+ *
+ *      Checks whether a local file starts with the digest file magic.
+ *
+ * Results:
+ *      true for a digest file.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+MerkleTree::IsDigestFile(const char *path) // IN
+{
+   FILE *file = fopen(path, "rb");
+   char magic[8];
+   bool isDigest;
+
+   if (file == NULL) {
+      return false;
+   }
+   isDigest = fread(magic, sizeof magic, 1, file) == 1 &&
+              memcmp(magic, MERKLE_MAGIC, sizeof magic) == 0;
+   fclose(file);
+   return isDigest;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MerkleTree::BuildThread --
+ *
+ *      Body of a thread of MerkleTree::Build: claims chunks in order,
+ *      reads them and stores their hash as leaves.
+ *
+ * Results:
+ *      TASK_OK.
+ *
+ * Side effects:
+ *      Sets the error of its thread data on failure.
+ *
+ *----------------------------------------------------------------------
+ */
+
+TaskResult TASK_CALL
+MerkleTree::BuildThread(void *arg) // IN
+{
+   BuildThreadData *td = (BuildThreadData *)arg;
+   MerkleTree *tree = td->tree;
+   VixDiskLibSectorType chunkSectors = tree->_header.chunkSectors;
+   IoBuffer buf(chunkSectors * VIXDISKLIB_SECTOR_SIZE);
+   uint64 i;
+
+   while ((i = (*td->next)++) < tree->_header.numLeaves) {
+      VixDiskLibSectorType sector = i * chunkSectors;
+      VixDiskLibSectorType numSectors =
+         std::min(chunkSectors, tree->_header.capacity - sector);
+
+      rateLimiter.Acquire(numSectors);
+      td->error = VixDiskLib_Read(td->handle, sector, numSectors, buf.Get());
+      if (VIX_FAILED(td->error)) {
+         break;
+      }
+      tree->_nodes[i] = Hash64(buf.Get(), numSectors * VIXDISKLIB_SECTOR_SIZE,
+                               0);
+   }
+   return TASK_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MerkleTree::Build --
+ *
+ *      Computes the tree of a disk, reading it with appGlobals.numReaders
+ *      threads, each on its own handle.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Throws on failure.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+MerkleTree::Build(const char *path,                   // IN
+                  VixDiskLibSectorType chunkSectors)  // IN
+{
+   vector<BuildThreadData> threadData(appGlobals.numReaders);
+   std::atomic<uint64> next(0);
+   VixError vixError;
+   uint64 elapsedNs;
+   size_t i;
+
+   for (i = 0; i < threadData.size(); i++) {
+      threadData[i].tree = this;
+      threadData[i].next = &next;
+   }
+   _header.chunkSectors = chunkSectors;
+   vixError = RunReaders(path, threadData, &BuildThread,
+                         chunkSectors * VIXDISKLIB_SECTOR_SIZE, &BuildSetup,
+                         this, &elapsedNs);
+   CHECK_AND_THROW(vixError);
+
+   HashLevels();
+   printf("Digest of %s: %d chunks, %d MBytes/sec, root %016" FMT64 "x\n",
+          path, (uint32)_header.numLeaves,
+          (uint32)(_header.capacity * VIXDISKLIB_SECTOR_SIZE * 1e3 /
+                   (1024 * 1024) / std::max(elapsedNs / 1e6, 1e-3)),
+          Root());
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MerkleTree::Save --
+ *
+ *      Writes the tree to a digest file.
+ *
+ * Results:
+ *      false if the file cannot be written.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+MerkleTree::Save(const char *path) const // IN
+{
+   FILE *file = fopen(path, "wb");
+   bool ok;
+
+   if (file == NULL) {
+      printf("Error: Cannot create digest file %s.\n", path);
+      return false;
+   }
+   ok = fwrite(&_header, sizeof _header, 1, file) == 1 &&
+        fwrite(_nodes.data(), sizeof(uint64), _nodes.size(), file) ==
+        _nodes.size();
+   if (fclose(file) != 0 || !ok) {
+      printf("Error: Cannot write digest file %s.\n", path);
+      return false;
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MerkleTree::Load --
+ *
+ *      Reads a digest file written by Save.
+ *
+ * Results:
+ *      false if the file cannot be read or is not a digest file.
+ *
+ * Side effects:
+ *      Replaces the tree.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+MerkleTree::Load(const char *path) // IN
+{
+   FILE *file = fopen(path, "rb");
+   MerkleHeader header;
+   long size;
+   bool ok;
+
+   if (file == NULL) {
+      printf("Error: Cannot open digest file %s.\n", path);
+      return false;
+   }
+   // The header must describe exactly the nodes that follow it, so that
+   // a corrupt one cannot make Init allocate more than the file holds.
+   ok = fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 0 &&
+        fseek(file, 0, SEEK_SET) == 0 &&
+        fread(&header, sizeof header, 1, file) == 1 &&
+        memcmp(header.magic, MERKLE_MAGIC, sizeof header.magic) == 0 &&
+        header.chunkSectors != 0 &&
+        header.numLeaves == LeafCount(header.capacity, header.chunkSectors) &&
+        header.numLeaves <= (uint64)size / sizeof(uint64) &&
+        (uint64)size == sizeof header +
+                        NodeCount(header.numLeaves) * sizeof(uint64);
+   if (ok) {
+      Init(header.capacity, header.chunkSectors);
+      ok = fread(_nodes.data(), sizeof(uint64), _nodes.size(), file) ==
+           _nodes.size();
+   }
+   fclose(file);
+   if (!ok) {
+      printf("Error: %s is not a valid digest file.\n", path);
+   }
+   return ok;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoDigest --
+ *
+ *      Computes the hash tree of a disk and saves it to a digest file.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Creates the digest file.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoDigest(void)
+{
+   MerkleTree tree;
+
+   tree.Build(appGlobals.diskPath, appGlobals.chunkMB * 2048);
+   if (!tree.Save(appGlobals.digestFile)) {
+      THROW_ERROR(VIX_E_FAIL);
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoDiff --
+ *
+ *      Compares two disks, each given as a vmdk or a digest file, by
+ *      their hash trees, and prints the extents where they differ. With
+ *      -extents, also saves the list in the format -copy -extents reads.
+ *      A disk compared with a digest file is hashed in chunks of the
+ *      digest's size.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoDiff(void)
+{
+   const char *paths[2] = { appGlobals.diskPath, appGlobals.diffPath };
+   bool isDigest[2];
+   MerkleTree trees[2];
+   vector<VixDiskLibBlock> extents;
+   VixDiskLibSectorType chunkSectors = appGlobals.chunkMB * 2048;
+   VixDiskLibSectorType differing = 0;
+   uint64 visited;
+   size_t i;
+
+   for (i = 0; i < 2; i++) {
+      isDigest[i] = MerkleTree::IsDigestFile(paths[i]);
+      if (isDigest[i]) {
+         if (!trees[i].Load(paths[i])) {
+            THROW_ERROR(VIX_E_INVALID_ARG);
+         }
+         chunkSectors = trees[i].ChunkSectors();
+      }
+   }
+   for (i = 0; i < 2; i++) {
+      if (!isDigest[i]) {
+         trees[i].Build(paths[i], chunkSectors);
+      }
+   }
+   if (!trees[0].SameShape(trees[1])) {
+      printf("Error: %s and %s differ in capacity or chunk size.\n",
+             paths[0], paths[1]);
+      THROW_ERROR(VIX_E_INVALID_ARG);
+   }
+
+   visited = trees[0].Diff(trees[1], extents);
+   for (i = 0; i < extents.size(); i++) {
+      printf("Differs: sectors %" FMT64 "u-%" FMT64 "u\n", extents[i].offset,
+             extents[i].offset + extents[i].length - 1);
+      differing += extents[i].length;
+   }
+   printf("%d differing extents (%d MBytes), compared %d of %d tree "
+          "nodes.\n", (uint32)extents.size(), (uint32)(differing / 2048),
+          (uint32)visited, (uint32)trees[0].NumNodes());
+
+   if (appGlobals.extentFile != NULL) {
+      FILE *file = fopen(appGlobals.extentFile, "w");
+      bool ok;
+
+      if (file == NULL) {
+         printf("Error: Cannot create extent list %s.\n",
+                appGlobals.extentFile);
+         THROW_ERROR(VIX_E_FAIL);
+      }
+      uint64 unit = appGlobals.extentBytes ? VIXDISKLIB_SECTOR_SIZE : 1;
+
+      for (i = 0; i < extents.size(); i++) {
+         fprintf(file, "%" FMT64 "u %" FMT64 "u\n", extents[i].offset * unit,
+                 extents[i].length * unit);
+      }
+      ok = !ferror(file);
+      if (fclose(file) != 0 || !ok) {
+         printf("Error: Cannot write extent list %s.\n",
+                appGlobals.extentFile);
+         THROW_ERROR(VIX_E_FAIL);
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FindPattern --
+ *
+ *      Finds the first occurrence of a pattern in a buffer. With SSE2,
+ *      16 positions are tested at once for the pattern's first and last
+ *      bytes, and only those matching both are compared in full.
+ *
+ * Results:
+ *      Offset of the match, or len if there is none.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static size_t
+FindPattern(const uint8 *buf,        // IN
+            size_t len,              // IN
+            const string &pattern)   // IN
+{
+   const uint8 *needle = (const uint8 *)pattern.data();
+   size_t m = pattern.size();
+   size_t i = 0;
+
+   if (m == 0 || m > len) {
+      return len;
+   }
+#ifdef HAVE_SSE2
+   __m128i first = _mm_set1_epi8((char)needle[0]);
+   __m128i last = _mm_set1_epi8((char)needle[m - 1]);
+
+   for (; i + m - 1 + 16 <= len; i += 16) {
+      __m128i blockFirst = _mm_loadu_si128((const __m128i *)(buf + i));
+      __m128i blockLast = _mm_loadu_si128((const __m128i *)(buf + i + m - 1));
+      unsigned mask = _mm_movemask_epi8(
+         _mm_and_si128(_mm_cmpeq_epi8(first, blockFirst),
+                       _mm_cmpeq_epi8(last, blockLast)));
+      unsigned bit;
+
+      for (bit = 0; mask != 0; bit++, mask >>= 1) {
+         if ((mask & 1) && memcmp(buf + i + bit, needle, m) == 0) {
+            return i + bit;
+         }
+      }
+   }
+#endif
+   for (; i + m <= len; i++) {
+      const uint8 *p = (const uint8 *)memchr(buf + i, needle[0],
+                                             len - m + 1 - i);
+
+      if (p == NULL) {
+         break;
+      }
+      i = p - buf;
+      if (memcmp(p, needle, m) == 0) {
+         return i;
+      }
+   }
+   return len;
+}
+
+
+// A -search match: byte offset on the disk, and index of the pattern.
+struct SearchMatch {
+   uint64 offset;
+   uint32 pattern;
+
+   bool operator<(const SearchMatch &other) const
+   {
+      return offset < other.offset ||
+             (offset == other.offset && pattern < other.pattern);
+   }
+};
+
+// Matches printed so far by the -search threads. A thread prints the
+// matches of its chunk once the chunks before it are printed, so the
+// output is in disk order and only the chunks in flight are held.
+struct SearchOutput {
+   SearchOutput() : nextChunk(0), numMatches(0), failed(false) { }
+
+   Mutex lock;
+   CondVar printed;
+   size_t nextChunk;                   // the chunk whose turn it is
+   uint64 numMatches;
+   bool failed;
+};
+
+// Chunks searched by -search, set up by SearchSetup.
+struct SearchPlan {
+   bool allSectors;                    // a pattern contains a zero byte
+   vector<VixDiskLibBlock> chunks;
+};
+
+// State of one -search thread. Threads claim chunks of the extent list
+// in order, and read each with enough sectors past its end that a match
+// starting in the chunk is seen whole.
+struct SearchThreadData {
+   const vector<VixDiskLibBlock> *chunks;
+   std::atomic<size_t> *next;
+   SearchOutput *output;
+   VixDiskLibHandle handle;
+   VixDiskLibSectorType capacity;
+   VixDiskLibSectorType overlapSectors;
+   VixDiskLibSectorType sectors;
+   VixError error;
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SearchThread --
+ *
+ *      Body of a -search thread.
+ *
+ * Results:
+ *      TASK_OK.
+ *
+ * Side effects:
+ *      Prints the matches of its chunks. Fills in the sectors and error
+ *      of its thread data.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TaskResult TASK_CALL
+SearchThread(void *arg) // IN
+{
+   SearchThreadData *td = (SearchThreadData *)arg;
+   SearchOutput *output = td->output;
+   IoBuffer buf((appGlobals.chunkMB * 2048 + td->overlapSectors) *
+                VIXDISKLIB_SECTOR_SIZE);
+   vector<SearchMatch> matches;
+   size_t i, j;
+
+   while ((i = (*td->next)++) < td->chunks->size()) {
+      const VixDiskLibBlock &chunk = (*td->chunks)[i];
+      VixDiskLibSectorType numSectors =
+         std::min(chunk.length + td->overlapSectors,
+                  td->capacity - chunk.offset);
+      size_t chunkLen = chunk.length * VIXDISKLIB_SECTOR_SIZE;
+      size_t len = numSectors * VIXDISKLIB_SECTOR_SIZE;
+      uint32 k;
+
+      rateLimiter.Acquire(numSectors);
+      td->error = VixDiskLib_Read(td->handle, chunk.offset, numSectors,
+                                  buf.Get());
+      if (VIX_FAILED(td->error)) {
+         // Stops the threads waiting for this chunk's turn.
+         output->lock.Lock();
+         output->failed = true;
+         output->printed.Broadcast();
+         output->lock.Unlock();
+         break;
+      }
+      td->sectors += chunk.length;
+      matches.clear();
+      for (k = 0; k < searchPatterns.size(); k++) {
+         size_t pos = 0;
+
+         // Matches starting past chunkLen belong to the next chunk.
+         while ((pos += FindPattern(buf.Get() + pos, len - pos,
+                                    searchPatterns[k])) < chunkLen) {
+            SearchMatch match;
+
+            match.offset = chunk.offset * VIXDISKLIB_SECTOR_SIZE + pos;
+            match.pattern = k;
+            matches.push_back(match);
+            pos++;
+         }
+      }
+      std::sort(matches.begin(), matches.end());
+
+      output->lock.Lock();
+      while (output->nextChunk != i && !output->failed) {
+         output->printed.Wait(output->lock);
+      }
+      if (output->failed) {
+         output->lock.Unlock();
+         break;
+      }
+      for (j = 0; j < matches.size(); j++) {
+         printf("Match at byte %" FMT64 "u (sector %" FMT64 "u): pattern %d\n",
+                matches[j].offset, matches[j].offset / VIXDISKLIB_SECTOR_SIZE,
+                matches[j].pattern + 1);
+      }
+      output->numMatches += matches.size();
+      output->nextChunk++;
+      output->printed.Broadcast();
+      output->lock.Unlock();
+   }
+   return TASK_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SearchSetup --
+ *
+ *      RunReaders setup of DoSearch: splits the allocated extents of the
+ *      disk, or the whole disk, into -chunk sized chunks.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Fills in the chunks of the SearchPlan at data.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SearchSetup(VixDiskLibHandle handle,       // IN
+            VixDiskLibSectorType capacity, // IN
+            void *data)                    // IN/OUT
+{
+   SearchPlan *plan = (SearchPlan *)data;
+   VixDiskLibSectorType chunkSectors = appGlobals.chunkMB * 2048;
+   vector<VixDiskLibBlock> extents;
+   size_t i;
+
+   if (plan->allSectors) {
+      VixDiskLibBlock all = { 0, capacity };
+
+      extents.push_back(all);
+   } else if (!QueryAllocatedExtents(handle, capacity, CopyGranule(),
+                                     extents)) {
+      printf("Allocation map of %s is not available, searching all "
+             "sectors.\n", appGlobals.diskPath);
+   }
+   for (i = 0; i < extents.size(); i++) {
+      VixDiskLibBlock chunk;
+
+      for (chunk.offset = extents[i].offset;
+           chunk.offset < extents[i].offset + extents[i].length;
+           chunk.offset += chunk.length) {
+         chunk.length = std::min(chunkSectors, extents[i].offset +
+                                 extents[i].length - chunk.offset);
+         plan->chunks.push_back(chunk);
+      }
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoSearch --
+ *
+ *      Searches a disk for the -search patterns with appGlobals.numReaders
+ *      threads, each on its own handle, and prints the byte offset of
+ *      every match as the search goes. Unallocated regions read as
+ *      zeros, so they are skipped unless a pattern contains a zero byte.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoSearch(void)
+{
+   vector<SearchThreadData> threadData(appGlobals.numReaders);
+   SearchPlan plan;
+   SearchOutput output;
+   VixDiskLibSectorType overlapSectors, sectors = 0;
+   std::atomic<size_t> next(0);
+   VixError vixError;
+   size_t maxLen = 0, i;
+   uint64 elapsedNs;
+
+   plan.allSectors = false;
+   for (i = 0; i < searchPatterns.size(); i++) {
+      maxLen = std::max(maxLen, searchPatterns[i].size());
+      plan.allSectors = plan.allSectors ||
+                        searchPatterns[i].find('\0') != string::npos;
+   }
+   overlapSectors = (maxLen - 1 + VIXDISKLIB_SECTOR_SIZE - 1) /
+                    VIXDISKLIB_SECTOR_SIZE;
+   for (i = 0; i < threadData.size(); i++) {
+      threadData[i].chunks = &plan.chunks;
+      threadData[i].next = &next;
+      threadData[i].output = &output;
+      threadData[i].overlapSectors = overlapSectors;
+      threadData[i].sectors = 0;
+   }
+   vixError = RunReaders(appGlobals.diskPath, threadData, &SearchThread,
+                         (appGlobals.chunkMB * 2048 + overlapSectors) *
+                         VIXDISKLIB_SECTOR_SIZE, &SearchSetup, &plan,
+                         &elapsedNs);
+   for (i = 0; i < threadData.size(); i++) {
+      sectors += threadData[i].sectors;
+   }
+   CHECK_AND_THROW(vixError);
+
+   printf("%" FMT64 "u matches in %d of %d MBytes searched in %d msec "
+          "(%d MBytes/sec).\n", output.numMatches,
+          (uint32)(sectors / 2048), (uint32)(threadData[0].capacity / 2048),
+          (uint32)(elapsedNs / 1000000),
+          (uint32)(sectors * VIXDISKLIB_SECTOR_SIZE * 1e3 / (1024 * 1024) /
+                   std::max(elapsedNs / 1e6, 1e-3)));
+}
+
+
+// -profile regions at or above this entropy, in bits per byte, count as
+// incompressible (encrypted or already compressed data)
+#define PROFILE_HIGH_ENTROPY 7.5
+
+// Data blocks of PROFILE_DEDUP_BLOCK bytes whose hash has the bits of the
+// sample mask clear are sampled to estimate the share of duplicate blocks.
+// The mask grows with the disk so that at most about PROFILE_DEDUP_SAMPLES
+// hashes are kept.
+#define PROFILE_DEDUP_BLOCK 4096
+#define PROFILE_DEDUP_SAMPLES (1 << 20)
+
+// Content of one -profile region.
+struct ProfileRegion {
+   VixDiskLibSectorType allocatedSectors;
+   VixDiskLibSectorType zeroSectors;   // in all-zero ZERO_BLOCK_SECTORS blocks
+   double entropy;                     // bits per byte of the other blocks
+};
+
+// Regions profiled by -profile, set up by ProfileSetup.
+struct ProfilePlan {
+   vector<ProfileRegion> regions;
+   uint64 sampleMask;
+};
+
+// State of one -profile thread.
+struct ProfileThreadData {
+   ProfilePlan *plan;
+   std::atomic<size_t> *next;
+   VixDiskLibHandle handle;
+   VixDiskLibSectorType capacity;
+   vector<uint64> sampledHashes;
+   VixError error;
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ByteHistogram --
+ *
+ *      Counts the byte values of a buffer into four histograms, one per
+ *      byte lane of 32 bits, so that runs of equal bytes do not wait for
+ *      each other's increments, and sums them into counts.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Adds to counts.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ByteHistogram(const uint8 *buf,  // IN
+              size_t len,        // IN
+              uint64 *counts)    // IN/OUT: 256 counters
+{
+   uint32 lanes[4][256];
+   size_t i;
+   int k;
+
+   memset(lanes, 0, sizeof lanes);
+   for (i = 0; i + 8 <= len; i += 8) {
+      uint64 v;
+
+      memcpy(&v, buf + i, 8);
+      lanes[0][v & 0xFF]++;
+      lanes[1][(v >> 8) & 0xFF]++;
+      lanes[2][(v >> 16) & 0xFF]++;
+      lanes[3][(v >> 24) & 0xFF]++;
+      lanes[0][(v >> 32) & 0xFF]++;
+      lanes[1][(v >> 40) & 0xFF]++;
+      lanes[2][(v >> 48) & 0xFF]++;
+      lanes[3][v >> 56]++;
+   }
+   for (; i < len; i++) {
+      lanes[0][buf[i]]++;
+   }
+   for (k = 0; k < 256; k++) {
+      counts[k] += lanes[0][k] + lanes[1][k] + lanes[2][k] + lanes[3][k];
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ProfileThread --
+ *
+ *      Body of a -profile thread: claims regions in order, and reads and
+ *      profiles the allocated ones.
+ *
+ * Results:
+ *      TASK_OK.
+ *
+ * Side effects:
+ *      Fills in the regions, and the sampled hashes and error of its
+ *      thread data.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TaskResult TASK_CALL
+ProfileThread(void *arg) // IN
+{
+   ProfileThreadData *td = (ProfileThreadData *)arg;
+   VixDiskLibSectorType regionSectors = appGlobals.chunkMB * 2048;
+   IoBuffer buf(regionSectors * VIXDISKLIB_SECTOR_SIZE);
+   size_t i;
+
+   while ((i = (*td->next)++) < td->plan->regions.size()) {
+      ProfileRegion &region = td->plan->regions[i];
+      VixDiskLibSectorType sector = i * regionSectors;
+      VixDiskLibSectorType numSectors = std::min(regionSectors,
+                                                 td->capacity - sector);
+      uint64 counts[256] = { 0 };
+      uint64 dataBytes = 0;
+      size_t off, len = numSectors * VIXDISKLIB_SECTOR_SIZE;
+      int k;
+
+      if (region.allocatedSectors == 0) {
+         region.zeroSectors = numSectors;
+         continue;
+      }
+      rateLimiter.Acquire(numSectors);
+      td->error = VixDiskLib_Read(td->handle, sector, numSectors, buf.Get());
+      if (VIX_FAILED(td->error)) {
+         break;
+      }
+      for (off = 0; off < len;
+           off += ZERO_BLOCK_SECTORS * VIXDISKLIB_SECTOR_SIZE) {
+         size_t blockLen = std::min((size_t)ZERO_BLOCK_SECTORS *
+                                    VIXDISKLIB_SECTOR_SIZE, len - off);
+         size_t seg;
+
+         if (IsZeroBuffer(buf.Get() + off, blockLen)) {
+            region.zeroSectors += blockLen / VIXDISKLIB_SECTOR_SIZE;
+            continue;
+         }
+         ByteHistogram(buf.Get() + off, blockLen, counts);
+         dataBytes += blockLen;
+         for (seg = 0; seg + PROFILE_DEDUP_BLOCK <= blockLen;
+              seg += PROFILE_DEDUP_BLOCK) {
+            uint64 h = Hash64(buf.Get() + off + seg, PROFILE_DEDUP_BLOCK, 0);
+
+            if ((h & td->plan->sampleMask) == 0) {
+               td->sampledHashes.push_back(h);
+            }
+         }
+      }
+      for (k = 0; k < 256; k++) {
+         if (counts[k] != 0) {
+            double p = (double)counts[k] / dataBytes;
+
+            region.entropy -= p * log(p) / log(2.0);
+         }
+      }
+   }
+   return TASK_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ProfileSetup --
+ *
+ *      RunReaders setup of DoProfile: creates the regions of the disk
+ *      with their allocated sectors, and picks the dedup sample mask.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Fills in the ProfilePlan at data.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ProfileSetup(VixDiskLibHandle handle,       // IN
+             VixDiskLibSectorType capacity, // IN
+             void *data)                    // IN/OUT
+{
+   ProfilePlan *plan = (ProfilePlan *)data;
+   VixDiskLibSectorType regionSectors = appGlobals.chunkMB * 2048;
+   ProfileRegion empty = { 0, 0, 0.0 };
+   vector<VixDiskLibBlock> extents;
+   uint64 numBlocks = capacity * VIXDISKLIB_SECTOR_SIZE / PROFILE_DEDUP_BLOCK;
+   size_t i;
+
+   plan->regions.assign((capacity + regionSectors - 1) / regionSectors,
+                        empty);
+   if (!QueryAllocatedExtents(handle, capacity, CopyGranule(), extents)) {
+      printf("Allocation map of %s is not available, reading all "
+             "sectors.\n", appGlobals.diskPath);
+   }
+   // Spread the extents over the regions they overlap.
+   for (i = 0; i < extents.size(); i++) {
+      VixDiskLibSectorType sector = extents[i].offset;
+      VixDiskLibSectorType end = extents[i].offset + extents[i].length;
+
+      while (sector < end) {
+         VixDiskLibSectorType regionEnd =
+            (sector / regionSectors + 1) * regionSectors;
+
+         plan->regions[sector / regionSectors].allocatedSectors +=
+            std::min(end, regionEnd) - sector;
+         sector = std::min(end, regionEnd);
+      }
+   }
+   plan->sampleMask = 0;
+   while (numBlocks / (plan->sampleMask + 1) > PROFILE_DEDUP_SAMPLES) {
+      plan->sampleMask = plan->sampleMask * 2 + 1;
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoProfile --
+ *
+ *      Profiles the content of a disk in -chunk sized regions, with
+ *      appGlobals.numReaders threads each on its own handle: allocation,
+ *      share of all-zero blocks (which -copy does not write) and byte
+ *      entropy of the rest. Writes one CSV line per region to
+ *      appGlobals.profileFile, and prints totals with order-0 entropy
+ *      estimates of compression and a sampled estimate of duplicate
+ *      blocks.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Creates the CSV file.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoProfile(void)
+{
+   vector<ProfileThreadData> threadData(appGlobals.numReaders);
+   ProfilePlan plan;
+   vector<uint64> hashes;
+   VixDiskLibSectorType regionSectors = appGlobals.chunkMB * 2048;
+   VixDiskLibSectorType capacity;
+   VixDiskLibSectorType allocated = 0, zeros = 0, highEntropy = 0;
+   double dataBytes = 0, compressedBytes = 0;
+   std::atomic<size_t> next(0);
+   VixError vixError;
+   uint64 elapsedNs;
+   size_t i, duplicates = 0;
+   FILE *csv;
+
+   for (i = 0; i < threadData.size(); i++) {
+      threadData[i].plan = &plan;
+      threadData[i].next = &next;
+   }
+   vixError = RunReaders(appGlobals.diskPath, threadData, &ProfileThread,
+                         regionSectors * VIXDISKLIB_SECTOR_SIZE,
+                         &ProfileSetup, &plan, &elapsedNs);
+   capacity = threadData[0].capacity;
+   for (i = 0; i < threadData.size(); i++) {
+      hashes.insert(hashes.end(), threadData[i].sampledHashes.begin(),
+                    threadData[i].sampledHashes.end());
+   }
+   CHECK_AND_THROW(vixError);
+
+   csv = fopen(appGlobals.profileFile, "w");
+   if (csv == NULL) {
+      printf("Error: Cannot create %s.\n", appGlobals.profileFile);
+      THROW_ERROR(VIX_E_FAIL);
+   }
+   fprintf(csv, "sector,sectors,allocated_pct,zero_pct,entropy\n");
+   for (i = 0; i < plan.regions.size(); i++) {
+      const ProfileRegion &region = plan.regions[i];
+      VixDiskLibSectorType numSectors =
+         std::min(regionSectors, capacity - i * regionSectors);
+      double data = (double)(numSectors - region.zeroSectors) *
+                    VIXDISKLIB_SECTOR_SIZE;
+
+      fprintf(csv, "%" FMT64 "u,%" FMT64 "u,%.1f,%.1f,%.3f\n",
+              (uint64)i * regionSectors, numSectors,
+              100.0 * region.allocatedSectors / numSectors,
+              100.0 * region.zeroSectors / numSectors, region.entropy);
+      allocated += region.allocatedSectors;
+      zeros += region.zeroSectors;
+      dataBytes += data;
+      compressedBytes += data * region.entropy / 8;
+      if (region.entropy >= PROFILE_HIGH_ENTROPY) {
+         highEntropy += numSectors - region.zeroSectors;
+      }
+   }
+   if (fclose(csv) != 0) {
+      printf("Error: Cannot write %s.\n", appGlobals.profileFile);
+      THROW_ERROR(VIX_E_FAIL);
+   }
+
+   std::sort(hashes.begin(), hashes.end());
+   for (i = 1; i < hashes.size(); i++) {
+      duplicates += hashes[i] == hashes[i - 1];
+   }
+   printf("Profile of %s (%d regions written to %s):\n", appGlobals.diskPath,
+          (uint32)plan.regions.size(), appGlobals.profileFile);
+   printf("   %d MBytes, %d allocated, %d in zero blocks, %d of data\n",
+          (uint32)(capacity / 2048), (uint32)(allocated / 2048),
+          (uint32)(zeros / 2048), (uint32)(dataBytes / (1024 * 1024)));
+   printf("   data: %.2f bits/byte, about %d MBytes compressed (order-0 "
+          "entropy), %d MBytes at >= %.1f bits/byte\n",
+          dataBytes != 0 ? 8 * compressedBytes / dataBytes : 0.0,
+          (uint32)(compressedBytes / (1024 * 1024)),
+          (uint32)(highEntropy / 2048), PROFILE_HIGH_ENTROPY);
+   printf("   data: about %.1f%% duplicate %d KByte blocks (%d sampled)\n",
+          hashes.empty() ? 0.0 : 100.0 * duplicates / hashes.size(),
+          PROFILE_DEDUP_BLOCK / 1024, (uint32)hashes.size());
+   printf("   a -copy reads %d MBytes and writes %d MBytes; read in %d msec "
+          "here (%d MBytes/sec)\n", (uint32)(allocated / 2048),
+          (uint32)(dataBytes / (1024 * 1024)), (uint32)(elapsedNs / 1000000),
+          (uint32)(allocated * VIXDISKLIB_SECTOR_SIZE * 1e3 / (1024 * 1024) /
+                   std::max(elapsedNs / 1e6, 1e-3)));
+}
+
+
+// Log-bucketed latency histogram in the style of HdrHistogram: values are
+// grouped by power of two, and every power of two is split into
+// LATENCY_SUB_BUCKETS linear buckets, which bounds the relative error of
+// any reported percentile to about 3%.
+
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram() : _counts(LATENCY_BUCKETS) { Reset(); }
+
+    void Reset()
+    {
+       std::fill(_counts.begin(), _counts.end(), 0);
+       _count = 0;
+       _max = 0;
     }
-    appGlobals.diskPath = argv[i];
 
-    if (BitCount(appGlobals.command) != 1) {
-       printf("Error: Missing command. See usage below.\n");
-       return PrintUsage();
+    void Record(uint64 ns)
+    {
+       _counts[Index(ns)]++;
+       _count++;
+       if (ns > _max) {
+          _max = ns;
+       }
     }
 
-    if (appGlobals.isRemote) {
-       if (appGlobals.host == NULL ||
-           appGlobals.userName == NULL ||
-           appGlobals.password == NULL) {
-           printf("Error: Missing a mandatory option. ");
-           printf("-host, -user and -password must be specified. ");
-           printf("See usage below.\n");
-           return PrintUsage();
+    void Merge(const LatencyHistogram &other)
+    {
+       size_t i;
+
+       for (i = 0; i < _counts.size(); i++) {
+          _counts[i] += other._counts[i];
+       }
+       _count += other._count;
+       if (other._max > _max) {
+          _max = other._max;
        }
     }
 
-    /*
-     * TODO: More error checking for params, really
-     */
-    return 0;
+    uint64 Count() const { return _count; }
+    uint64 Max() const { return _max; }
+
+    // Returns the highest latency (in ns) of the fastest pct percent of
+    // the recorded requests.
+    uint64 Percentile(double pct) const
+    {
+       uint64 rank = (uint64)ceil(pct / 100.0 * _count);
+       uint64 seen = 0;
+       size_t i;
+
+       if (rank == 0) {
+          rank = 1;
+       }
+       for (i = 0; i < _counts.size(); i++) {
+          seen += _counts[i];
+          if (seen >= rank) {
+             uint64 value = HighestEquivalent(i);
+             return value < _max ? value : _max;
+          }
+       }
+       return _max;
+    }
+
+private:
+    static size_t Index(uint64 value)
+    {
+       int msb = 0;
+       uint64 v;
+
+       if (value < LATENCY_SUB_BUCKETS) {
+          return (size_t)value;
+       }
+       for (v = value; v > 1; v >>= 1) {
+          msb++;
+       }
+       return (msb - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS +
+              ((value >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+    }
+
+    static uint64 HighestEquivalent(size_t index)
+    {
+       size_t group = index / LATENCY_SUB_BUCKETS;
+       uint64 sub = index % LATENCY_SUB_BUCKETS;
+
+       if (group == 0) {
+          return sub;
+       }
+       return ((LATENCY_SUB_BUCKETS + sub + 1) << (group - 1)) - 1;
+    }
+
+    vector<uint64> _counts;
+    uint64 _count;
+    uint64 _max;
+};
+
+
+// Requests of one direction (reads or writes) completed by a benchmark.
+struct BenchStats {
+   uint64 ops;
+   uint64 sectors;
+   LatencyHistogram latency;
+
+   BenchStats() : ops(0), sectors(0) { }
+
+   void Record(VixDiskLibSectorType numSectors, uint64 ns)
+   {
+      ops++;
+      sectors += numSectors;
+      latency.Record(ns);
+   }
+
+   void Merge(const BenchStats &other)
+   {
+      ops += other.ops;
+      sectors += other.sectors;
+      latency.Merge(other.latency);
+   }
+
+   void Reset()
+   {
+      ops = 0;
+      sectors = 0;
+      latency.Reset();
+   }
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintStat --
+ *
+ *      Print performance statistics and request latency percentiles for
+ *      read/write benchmarks.
+ *
+ * Results:
+ *      Throughput in MBytes/sec.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint32
+PrintStat(bool read,                // IN
+          uint64 startNs,           // IN
+          uint64 endNs,             // IN
+          const BenchStats &stats)  // IN
+{
+   double elapsed;
+   uint32 speed, iops;
+
+   elapsed = (endNs - startNs) / 1e9;
+   if (elapsed <= 0) {
+      elapsed = 1e-9;
+   }
+   speed = (uint32)(VIXDISKLIB_SECTOR_SIZE * (double)stats.sectors /
+                    (1024 * 1024) / elapsed);
+   iops = (uint32)(stats.ops / elapsed);
+   printf("%s %d MBytes in %d msec (%d MBytes/sec, %d IOPS)\n",
+          read ? "Read" : "Wrote", (uint32)(stats.sectors /(2048)),
+          (uint32)(elapsed * 1000), speed, iops);
+   if (stats.latency.Count() != 0) {
+      printf("   latency usec: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f "
+             "max %.1f\n",
+             stats.latency.Percentile(50) / 1000.0,
+             stats.latency.Percentile(90) / 1000.0,
+             stats.latency.Percentile(99) / 1000.0,
+             stats.latency.Percentile(99.9) / 1000.0,
+             stats.latency.Max() / 1000.0);
+   }
+   return speed;
 }
 
 
 /*
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  *
- * DoInfo --
+ * PrintBenchStats --
  *
- *      Queries the information of a virtual disk.
+ *      Print the statistics of both directions of a benchmark run,
+ *      skipping a direction without any request.
  *
  * Results:
+ *      Combined throughput in MBytes/sec.
+ *
+ * Side effects:
  *      None.
  *
+ *----------------------------------------------------------------------
+ */
+
+static uint32
+PrintBenchStats(const string &label,      // IN
+                uint64 startNs,           // IN
+                uint64 endNs,             // IN
+                const BenchStats &reads,  // IN
+                const BenchStats &writes) // IN
+{
+   uint32 speed = 0;
+
+   if (reads.ops != 0) {
+      printf("%s", label.c_str());
+      speed += PrintStat(true, startNs, endNs, reads);
+   }
+   if (writes.ops != 0) {
+      printf("%s", label.c_str());
+      speed += PrintStat(false, startNs, endNs, writes);
+   }
+   return speed;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SplitMix64 --
+ *
+ *      Advances a 64 bit state and returns a well mixed pseudo random
+ *      value derived from it.
+ *
+ * Results:
+ *      Pseudo random 64 bit value.
+ *
+ * Side effects:
+ *      Updates *state.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint64
+SplitMix64(uint64 *state) // IN/OUT
+{
+   uint64 z = (*state += 0x9E3779B97F4A7C15ULL);
+
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+   return z ^ (z >> 31);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FillRandom --
+ *
+ *      Fills a buffer with four interleaved xorshift128+ streams seeded
+ *      from key, two 64 bit lanes per SSE2 register where available.
+ *      The scalar path produces the same bytes.
+ *
+ * Results:
+ *      None
+ *
  * Side effects:
  *      None.
  *
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  */
 
 static void
-DoInfo(void)
+FillRandom(uint8 *buf,   // OUT
+           size_t len,   // IN
+           uint64 key)   // IN
 {
-    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
-    VixDiskLibInfo *info = NULL;
-    VixError vixError;
+   uint64 s0[4], s1[4], out[4];
+   size_t i, rounds = len / sizeof out;
+   int k;
 
-    vixError = VixDiskLib_GetInfo(disk.Handle(), &info);
+   for (k = 0; k < 4; k++) {
+      s0[k] = SplitMix64(&key);
+      s1[k] = SplitMix64(&key);
+   }
 
-    CHECK_AND_THROW(vixError);
+#ifdef HAVE_SSE2
+   __m128i a0 = _mm_loadu_si128((const __m128i *)&s0[0]);
+   __m128i a1 = _mm_loadu_si128((const __m128i *)&s0[2]);
+   __m128i b0 = _mm_loadu_si128((const __m128i *)&s1[0]);
+   __m128i b1 = _mm_loadu_si128((const __m128i *)&s1[2]);
+
+   for (i = 0; i < rounds; i++) {
+      __m128i x0 = a0, x1 = a1;
+
+      a0 = b0;
+      a1 = b1;
+      x0 = _mm_xor_si128(x0, _mm_slli_epi64(x0, 23));
+      x1 = _mm_xor_si128(x1, _mm_slli_epi64(x1, 23));
+      b0 = _mm_xor_si128(_mm_xor_si128(x0, a0),
+                         _mm_xor_si128(_mm_srli_epi64(x0, 17),
+                                       _mm_srli_epi64(a0, 26)));
+      b1 = _mm_xor_si128(_mm_xor_si128(x1, a1),
+                         _mm_xor_si128(_mm_srli_epi64(x1, 17),
+                                       _mm_srli_epi64(a1, 26)));
+      _mm_storeu_si128((__m128i *)(buf + i * sizeof out),
+                       _mm_add_epi64(b0, a0));
+      _mm_storeu_si128((__m128i *)(buf + i * sizeof out + 16),
+                       _mm_add_epi64(b1, a1));
+   }
+   _mm_storeu_si128((__m128i *)&s0[0], a0);
+   _mm_storeu_si128((__m128i *)&s0[2], a1);
+   _mm_storeu_si128((__m128i *)&s1[0], b0);
+   _mm_storeu_si128((__m128i *)&s1[2], b1);
+#else
+   for (i = 0; i < rounds; i++) {
+      for (k = 0; k < 4; k++) {
+         uint64 x = s0[k];
+
+         s0[k] = s1[k];
+         x ^= x << 23;
+         s1[k] = x ^ s0[k] ^ (x >> 17) ^ (s0[k] >> 26);
+         out[k] = s1[k] + s0[k];
+      }
+      memcpy(buf + i * sizeof out, out, sizeof out);
+   }
+#endif
 
-    cout << "capacity          = " << info->capacity << " sectors" << endl;
-    cout << "number of links   = " << info->numLinks << endl;
-    cout << "adapter type      = ";
-    switch (info->adapterType) {
-    case VIXDISKLIB_ADAPTER_IDE:
-       cout << "IDE" << endl;
-       break;
-    case VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC:
-       cout << "BusLogic SCSI" << endl;
-       break;
-    case VIXDISKLIB_ADAPTER_SCSI_LSILOGIC:
-       cout << "LsiLogic SCSI" << endl;
-       break;
-    default:
-       cout << "unknown" << endl;
-       break;
+   if (len % sizeof out != 0) {
+      for (k = 0; k < 4; k++) {
+         out[k] = s1[k] + s0[k] + SplitMix64(&key);
+      }
+      memcpy(buf + rounds * sizeof out, out, len % sizeof out);
+   }
+}
+
+
+// Produces the contents of benchmark writes. Every block gets its own
+// data, so deduplicating or compressing arrays cannot shortcut the
+// writes, unless asked to: dedupPct percent of the blocks repeat the
+// contents of an earlier block of the same stream, and compressPct
+// percent of every DATAGEN_SEGMENT bytes are zeros.
+
+#define DATAGEN_SEGMENT 4096
+
+class DataGenerator
+{
+public:
+    DataGenerator(uint64 seed,          // IN
+                  uint32 compressPct,   // IN
+                  uint32 dedupPct)      // IN
+       : _seed(seed),
+         _compressPct(compressPct),
+         _dedupPct(dedupPct),
+         _next(0)
+    {
     }
 
-    cout << "BIOS geometry     = " << info->biosGeo.cylinders <<
-       "/" << info->biosGeo.heads << "/" << info->biosGeo.sectors << endl;
+    void Fill(uint8 *buf,   // OUT
+              size_t len)   // IN
+    {
+       uint64 id = _next++;
+       size_t off;
 
-    cout << "physical geometry = " << info->physGeo.cylinders <<
-       "/" << info->physGeo.heads << "/" << info->physGeo.sectors << endl;
+       // A duplicate repeats an earlier block, which may itself be a
+       // duplicate: follow the chain down to a unique block.
+       while (id != 0 && IsDuplicate(id)) {
+          uint64 h = id ^ _seed ^ 0xD1B54A32D192ED03ULL;
 
-    VixDiskLib_FreeInfo(info);
+          id = SplitMix64(&h) % id;
+       }
 
-    cout << "Transport modes supported by vixDiskLib: " <<
-       VixDiskLib_ListTransportModes() << endl;
-}
+       for (off = 0; off < len; off += DATAGEN_SEGMENT) {
+          size_t segLen = std::min((size_t)DATAGEN_SEGMENT, len - off);
+          size_t randLen = segLen * (100 - _compressPct) / 100;
+          uint64 key = _seed ^ (id * 0x9E3779B97F4A7C15ULL) ^ off;
+
+          FillRandom(buf + off, randLen, key);
+          memset(buf + off + randLen, 0, segLen - randLen);
+       }
+    }
+
+private:
+    bool IsDuplicate(uint64 id) const
+    {
+       uint64 h = id ^ _seed;
+
+       return _dedupPct != 0 && SplitMix64(&h) % 100 < _dedupPct;
+    }
+
+    uint64 _seed;
+    uint32 _compressPct;
+    uint32 _dedupPct;
+    uint64 _next;
+};
 
 
 /*
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  *
- * DoCreate --
+ * FillSectors --
  *
- *      Creates a virtual disk.
+ *      Produces the -fillpattern contents of a run of sectors.
  *
  * Results:
  *      None.
@@ -1203,527 +8103,1006 @@ DoInfo(void)
  * Side effects:
  *      None.
  *
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  */
 
 static void
-DoCreate(void)
+FillSectors(uint8 *buf,                        // OUT
+            VixDiskLibSectorType sector,       // IN
+            VixDiskLibSectorType numSectors)   // IN
 {
-   VixDiskLibCreateParams createParams;
-   VixError vixError;
-
-   createParams.adapterType = appGlobals.adapterType;
-
-   createParams.capacity = appGlobals.mbSize * 2048;
-   createParams.diskType = VIXDISKLIB_DISK_MONOLITHIC_SPARSE;
-   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
-
-   vixError = VixDiskLib_Create(appGlobals.connection,
-                                appGlobals.diskPath,
-                                &createParams,
-                                NULL,
-                                NULL);
-   CHECK_AND_THROW(vixError);
+   size_t len = numSectors * VIXDISKLIB_SECTOR_SIZE;
+   VixDiskLibSectorType i;
+   size_t k;
+
+   switch (appGlobals.fillPattern) {
+   case FILL_ZERO:
+      memset(buf, 0, len);
+      break;
+   case FILL_LBA:
+      // Every 8 bytes of a sector hold its number, little-endian.
+      for (i = 0; i < numSectors; i++) {
+         uint8 *p = buf + i * VIXDISKLIB_SECTOR_SIZE;
+         uint64 lba = sector + i;
+
+         for (k = 0; k < 8; k++) {
+            p[k] = (uint8)(lba >> (8 * k));
+         }
+         for (k = 8; k < VIXDISKLIB_SECTOR_SIZE; k *= 2) {
+            memcpy(p + k, p, k);
+         }
+      }
+      break;
+   case FILL_RANDOM:
+      // Seeded per sector so the data does not depend on -chunk or -start.
+      for (i = 0; i < numSectors; i++) {
+         FillRandom(buf + i * VIXDISKLIB_SECTOR_SIZE, VIXDISKLIB_SECTOR_SIZE,
+                    appGlobals.seed ^ ((sector + i) * 0x9E3779B97F4A7C15ULL));
+      }
+      break;
+   default:
+      memset(buf, appGlobals.filler, len);
+      break;
+   }
 }
 
 
 /*
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  *
- * DoRedo --
+ * FillThread --
  *
- *      Creates a child disk.
+ *      Body of a -fill generator thread.
  *
  * Results:
- *      None.
+ *      TASK_OK.
  *
  * Side effects:
  *      None.
  *
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  */
 
-static void
-DoRedo(void)
+static TaskResult TASK_CALL
+FillThread(void *arg) // IN
 {
-   VixError vixError;
-   VixDisk parentDisk(appGlobals.connection, appGlobals.parentPath, 0);
-   vixError = VixDiskLib_CreateChild(parentDisk.Handle(),
-                                     appGlobals.diskPath,
-                                     VIXDISKLIB_DISK_MONOLITHIC_SPARSE,
-                                     NULL, NULL);
-   CHECK_AND_THROW(vixError);
+   FillState *state = (FillState *)arg;
+   PipelineChunk chunk;
+
+   while (state->free.Pop(&chunk) && !state->stop.load()) {
+      uint64 n = state->nextChunk++;
+
+      if (n * state->chunkSectors >= state->numSectors) {
+         state->free.TryPush(chunk);
+         break;
+      }
+      chunk.sector = state->startSector + n * state->chunkSectors;
+      chunk.numSectors = std::min(state->chunkSectors,
+                                  state->numSectors - n * state->chunkSectors);
+      FillSectors(chunk.buf, chunk.sector, chunk.numSectors);
+      state->full.TryPush(chunk);
+   }
+   return TASK_OK;
 }
 
 
+// Produces the order in which a benchmark thread visits the numBlocks
+// buffers of its share of the disk. The sequence only depends on the
+// pattern and the seed, so runs are reproducible.
+
+class AccessGenerator
+{
+public:
+    AccessGenerator(const PatternSpec &pattern, uint64 numBlocks, uint64 seed)
+       : _pattern(pattern.kind),
+         _numBlocks(numBlocks),
+         _state(seed),
+         _count(0),
+         _next(0),
+         _pass(0)
+    {
+       _stride = pattern.stride != 0 ? pattern.stride : DEFAULT_STRIDE;
+       if (_stride > _numBlocks) {
+          _stride = _numBlocks;
+       }
+       if (_pattern == PATTERN_ZIPF) {
+          InitZipf(pattern.zipfTheta);
+       }
+    }
+
+    // Returns the index of the next buffer, in [0, numBlocks).
+    uint64 Next()
+    {
+       uint64 block;
+
+       switch (_pattern) {
+       case PATTERN_REVERSE:
+          block = _numBlocks - 1 - _count % _numBlocks;
+          break;
+       case PATTERN_STRIDED:
+          // Visit every stride-th buffer, then start over one buffer
+          // further until all buffers have been visited.
+          block = _next;
+          _next += _stride;
+          if (_next >= _numBlocks) {
+             _pass = (_pass + 1) % _stride;
+             _next = _pass;
+          }
+          break;
+       case PATTERN_RANDOM:
+          block = SplitMix64(&_state) % _numBlocks;
+          break;
+       case PATTERN_ZIPF:
+          // Scramble the ranks so the hot set is spread over the region.
+          block = NextZipf();
+          block = SplitMix64(&block) % _numBlocks;
+          break;
+       default:
+          block = _count % _numBlocks;
+          break;
+       }
+       _count++;
+       return block;
+    }
+
+private:
+    // Rejection-inversion Zipf sampling (Hormann and Derflinger), which
+    // needs no per-element tables and so scales to any disk size.
+    void InitZipf(double theta)
+    {
+       _theta = theta;
+       _hX1 = H(1.5) - 1.0;
+       _hN = H(_numBlocks + 0.5);
+       _s = 2.0 - HInverse(H(2.5) - Density(2.0));
+    }
+
+    uint64 NextZipf()
+    {
+       for (;;) {
+          double u = _hN + Uniform() * (_hX1 - _hN);
+          double x = HInverse(u);
+          double k = floor(x + 0.5);
+
+          if (k < 1.0) {
+             k = 1.0;
+          } else if (k > (double)_numBlocks) {
+             k = (double)_numBlocks;
+          }
+          if (k - x <= _s || u >= H(k + 0.5) - Density(k)) {
+             return (uint64)k - 1;
+          }
+       }
+    }
+
+    double Uniform() { return (SplitMix64(&_state) >> 11) * (1.0 / 9007199254740992.0); }
+    double Density(double x) { return exp(-_theta * log(x)); }
+
+    double H(double x)
+    {
+       double logX = log(x);
+       double t = (1.0 - _theta) * logX;
+
+       // (exp(t) - 1) / t, continuous at t == 0.
+       return (fabs(t) > 1e-8 ? expm1(t) / t : 1.0 + t / 2.0) * logX;
+    }
+
+    double HInverse(double x)
+    {
+       double t = x * (1.0 - _theta);
+
+       if (t < -1.0) {
+          t = -1.0;
+       }
+       // log(1 + t) / t, continuous at t == 0.
+       return exp((fabs(t) > 1e-8 ? log1p(t) / t : 1.0 - t / 2.0) * x);
+    }
+
+    BenchPattern _pattern;
+    uint64 _numBlocks;
+    uint64 _state;
+    uint64 _count;
+    uint64 _stride;
+    uint64 _next;
+    uint64 _pass;
+    double _theta;
+    double _hX1;
+    double _hN;
+    double _s;
+};
+
+
 /*
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  *
- * DoFill --
+ * ParsePattern --
  *
- *      Writes to a virtual disk.
+ *      Parses an access pattern specification: seq, reverse, random,
+ *      stride[:n] or zipf[:theta].
  *
  * Results:
- *      None.
+ *      true if spec is valid.
  *
  * Side effects:
- *      None.
+ *      Fills in *pattern.
  *
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  */
 
-static void
-DoFill(void)
+static bool
+ParsePattern(const char *spec,       // IN
+             PatternSpec *pattern)   // OUT
 {
-    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
-    uint8 buf[VIXDISKLIB_SECTOR_SIZE];
-    VixDiskLibSectorType startSector;
+   const char *arg = strchr(spec, ':');
+   size_t len = arg != NULL ? arg - spec : strlen(spec);
+
+   pattern->stride = 0;
+   pattern->zipfTheta = DEFAULT_ZIPF_THETA;
+   if (arg == NULL && !strcmp(spec, "seq")) {
+      pattern->kind = PATTERN_SEQUENTIAL;
+   } else if (arg == NULL && !strcmp(spec, "reverse")) {
+      pattern->kind = PATTERN_REVERSE;
+   } else if (arg == NULL && !strcmp(spec, "random")) {
+      pattern->kind = PATTERN_RANDOM;
+   } else if (len == 6 && !strncmp(spec, "stride", len)) {
+      pattern->kind = PATTERN_STRIDED;
+      if (arg != NULL) {
+         pattern->stride = strtoull(arg + 1, NULL, 0);
+      }
+   } else if (len == 4 && !strncmp(spec, "zipf", len)) {
+      pattern->kind = PATTERN_ZIPF;
+      if (arg != NULL) {
+         pattern->zipfTheta = strtod(arg + 1, NULL);
+      }
+      if (pattern->zipfTheta <= 0) {
+         return false;
+      }
+   } else {
+      return false;
+   }
+   return true;
+}
 
-    memset(buf, appGlobals.filler, sizeof buf);
 
-    for (startSector = 0; startSector < appGlobals.numSectors; ++startSector) {
-       VixError vixError;
-       vixError = VixDiskLib_Write(disk.Handle(),
-                                   appGlobals.startSector + startSector,
-                                   1, buf);
-       CHECK_AND_THROW(vixError);
-    }
-}
+// One entry of a request size distribution: requests of sectors
+// sectors are picked with probability weight / (sum of all weights).
+struct BlockSize {
+   VixDiskLibSectorType sectors;
+   uint32 weight;
+};
+
+// Settings and results of one benchmark worker thread. A worker owns
+// numOps slots, slot k starting at firstSector + k * stride, and visits
+// them in the order given by the access pattern. Each request reads or
+// writes (readPct percent of reads) a size drawn from sizes, clipped to
+// endSector. Unless durationNs is set, a worker issues numOps requests.
+// Requests issued during the first warmupNs are not part of the results,
+// and neither duration nor numOps count them. Write data follows
+// compressPct and dedupPct, as for DataGenerator.
+struct BenchThreadData {
+   string name;
+   string diskPath;
+   uint32 openFlags;
+   VixDiskLibHandle handle;
+   uint32 readPct;
+   uint32 compressPct;
+   uint32 dedupPct;
+   vector<BlockSize> sizes;
+   PatternSpec pattern;
+   uint64 seed;
+   uint32 queueDepth;
+   VixDiskLibSectorType firstSector;
+   VixDiskLibSectorType stride;
+   VixDiskLibSectorType endSector;
+   uint64 numOps;
+   uint64 durationNs;
+   uint64 warmupNs;
+   bool reportIntervals;
+   uint64 startNs;
+   uint64 endNs;
+   BenchStats reads;
+   BenchStats writes;
+};
 
 
 /*
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  *
- * DoReadMetadata --
+ * MaxBlockSize --
  *
- *      Reads metadata from a virtual disk.
+ *      Largest request size of a benchmark worker.
  *
  * Results:
- *      None.
+ *      Size in sectors.
  *
  * Side effects:
  *      None.
  *
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  */
 
-static void
-DoReadMetadata(void)
+static VixDiskLibSectorType
+MaxBlockSize(const BenchThreadData *td) // IN
 {
-    size_t requiredLen;
-    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
-    VixError vixError = VixDiskLib_ReadMetadata(disk.Handle(),
-                                                appGlobals.metaKey,
-                                                NULL, 0, &requiredLen);
-    if (vixError != VIX_OK && vixError != VIX_E_BUFFER_TOOSMALL) {
-        THROW_ERROR(vixError);
-    }
-    std::vector <char> val(requiredLen);
-    vixError = VixDiskLib_ReadMetadata(disk.Handle(),
-                                       appGlobals.metaKey,
-                                       &val[0],
-                                       requiredLen,
-                                       NULL);
-    CHECK_AND_THROW(vixError);
-    cout << appGlobals.metaKey << " = " << &val[0] << endl;
+   VixDiskLibSectorType maxSize = 0;
+   size_t i;
+
+   for (i = 0; i < td->sizes.size(); i++) {
+      maxSize = std::max(maxSize, td->sizes[i].sectors);
+   }
+   return maxSize;
 }
 
 
 /*
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  *
- * DoWriteMetadata --
+ * BenchBufferSize --
  *
- *      Writes metadata in a virtual disk.
+ *      Size of the I/O buffer of a benchmark worker: one block of the
+ *      largest size, or, with a queue depth, one page-aligned block per
+ *      outstanding request.
  *
  * Results:
- *      None.
+ *      Size in bytes.
  *
  * Side effects:
  *      None.
  *
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  */
 
-static void
-DoWriteMetadata(void)
+static size_t
+BenchBufferSize(const BenchThreadData *td) // IN
 {
-    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
-    VixError vixError = VixDiskLib_WriteMetadata(disk.Handle(),
-                                                 appGlobals.metaKey,
-                                                 appGlobals.metaVal);
-    CHECK_AND_THROW(vixError);
+   size_t blockSize = MaxBlockSize(td) * VIXDISKLIB_SECTOR_SIZE;
+
+   if (td->queueDepth == 0) {
+      return blockSize;
+   }
+   return ((blockSize + POOL_PAGE_SIZE - 1) &
+           ~(size_t)(POOL_PAGE_SIZE - 1)) * td->queueDepth;
 }
 
 
+// Picks direction, position and size of the requests of a worker.
+
+class BenchRequestSource
+{
+public:
+    explicit BenchRequestSource(const BenchThreadData *td)
+       : _td(td),
+         _gen(td->pattern, td->numOps, td->seed),
+         _state(td->seed ^ 0x5DEECE66DULL),
+         _totalWeight(0),
+         _issued(0),
+         _warming(td->warmupNs != 0)
+    {
+       size_t i;
+
+       for (i = 0; i < td->sizes.size(); i++) {
+          _totalWeight += td->sizes[i].weight;
+       }
+    }
+
+    // Returns true once, when the warm-up period has elapsed. The caller
+    // then discards its statistics and restarts td->startNs.
+    bool EndWarmup(uint64 now)
+    {
+       if (!_warming || now - _td->startNs < _td->warmupNs) {
+          return false;
+       }
+       _warming = false;
+       _issued = 0;
+       return true;
+    }
+
+    // Returns true until the warm-up period has ended.
+    bool Warming() const { return _warming; }
+
+    // Returns false once the worker has issued all its requests. A
+    // worker without buffers has none to issue, even for -duration.
+    bool More(uint64 now) const
+    {
+       if (_td->numOps == 0) {
+          return false;
+       }
+       if (_warming) {
+          return true;
+       }
+       if (_td->durationNs != 0) {
+          return now - _td->startNs < _td->durationNs;
+       }
+       return _issued < _td->numOps;
+    }
+
+    void Next(bool *read,                         // OUT
+              VixDiskLibSectorType *sector,       // OUT
+              VixDiskLibSectorType *numSectors)   // OUT
+    {
+       *read = _td->readPct >= 100 ||
+               (_td->readPct > 0 && SplitMix64(&_state) % 100 < _td->readPct);
+       *numSectors = _td->sizes[0].sectors;
+       if (_td->sizes.size() > 1) {
+          uint64 pick = SplitMix64(&_state) % _totalWeight;
+          size_t i;
+
+          for (i = 0; pick >= _td->sizes[i].weight; i++) {
+             pick -= _td->sizes[i].weight;
+          }
+          *numSectors = _td->sizes[i].sectors;
+       }
+       *sector = _td->firstSector + _gen.Next() * _td->stride;
+       if (*sector + *numSectors > _td->endSector) {
+          *numSectors = _td->endSector - *sector;
+       }
+       _issued++;
+    }
+
+private:
+    const BenchThreadData *_td;
+    AccessGenerator _gen;
+    uint64 _state;
+    uint64 _totalWeight;
+    uint64 _issued;
+    bool _warming;
+};
+
+
+struct AsyncBench;
+
+// One outstanding request of the asynchronous read/write benchmark.
+struct AsyncRequest {
+   AsyncBench *bench;
+   uint8 *buf;
+   uint64 issueNs;
+   bool read;
+   VixDiskLibSectorType numSectors;
+};
+
+// State shared between DoAsyncBench and the completion callback, which
+// VixDiskLib invokes on one of its own threads.
+struct AsyncBench {
+   Mutex lock;
+   CondVar cond;
+   vector<AsyncRequest *> idle;
+   uint64 completed;
+   VixError error;
+   uint64 measureFromNs;
+   BenchStats reads;
+   BenchStats writes;
+};
+
+
 /*
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  *
- * DoDumpMetadata --
+ * AsyncBenchCallback --
  *
- *      Dumps all the metadata.
+ *      Completion callback for VixDiskLib_ReadAsync/WriteAsync issued by
+ *      the asynchronous benchmark.
  *
  * Results:
- *      None.
+ *      None
  *
  * Side effects:
- *      None.
+ *      Records the request latency, returns the request to the idle
+ *      list and wakes up the issuer.
  *
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  */
 
 static void
-DoDumpMetadata(void)
+AsyncBenchCallback(void *cbData,     // IN
+                   VixError result)  // IN
 {
-    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
-    char *key;
-    size_t requiredLen;
-
-    VixError vixError = VixDiskLib_GetMetadataKeys(disk.Handle(),
-                                                   NULL, 0, &requiredLen);
-    if (vixError != VIX_OK && vixError != VIX_E_BUFFER_TOOSMALL) {
-       THROW_ERROR(vixError);
-    }
-    std::vector<char> buf(requiredLen);
-    vixError = VixDiskLib_GetMetadataKeys(disk.Handle(), &buf[0], requiredLen, NULL);
-    CHECK_AND_THROW(vixError);
-    key = &buf[0];
-
-    while (*key) {
-        vixError = VixDiskLib_ReadMetadata(disk.Handle(), key, NULL, 0,
-                                           &requiredLen);
-        if (vixError != VIX_OK && vixError != VIX_E_BUFFER_TOOSMALL) {
-           THROW_ERROR(vixError);
-        }
-        std::vector <char> val(requiredLen);
-        vixError = VixDiskLib_ReadMetadata(disk.Handle(), key, &val[0],
-                                           requiredLen, NULL);
-        CHECK_AND_THROW(vixError);
-        cout << key << " = " << &val[0] << endl;
-        key += (1 + strlen(key));
-    }
+   AsyncRequest *req = (AsyncRequest *)cbData;
+   AsyncBench *bench = req->bench;
+   uint64 now = GetTimeNs();
+
+   bench->lock.Lock();
+   if (VIX_FAILED(result)) {
+      if (bench->error == VIX_OK) {
+         bench->error = result;
+      }
+   } else if (req->issueNs < bench->measureFromNs) {
+      // Issued during the warm-up period.
+   } else if (req->read) {
+      bench->reads.Record(req->numSectors, now - req->issueNs);
+   } else {
+      bench->writes.Record(req->numSectors, now - req->issueNs);
+   }
+   bench->idle.push_back(req);
+   bench->completed++;
+   bench->cond.Signal();
+   bench->lock.Unlock();
 }
 
 
 /*
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  *
- * DoDump --
+ * DoSyncBench --
  *
- *      Dumps the content of a virtual disk.
+ *      Issue the requests of a benchmark worker one synchronous request
+ *      at a time.
  *
  * Results:
- *      None.
+ *      None
  *
  * Side effects:
- *      None.
+ *      Fills in the timing and statistics of td.
  *
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  */
 
 static void
-DoDump(void)
+DoSyncBench(BenchThreadData *td) // IN/OUT
 {
-    VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
-    uint8 buf[VIXDISKLIB_SECTOR_SIZE];
-    VixDiskLibSectorType i;
+   IoBuffer buf(BenchBufferSize(td));
+   BenchRequestSource source(td);
+   DataGenerator data(td->seed, td->compressPct, td->dedupPct);
+   BenchStats reads, writes;
+   uint64 start, now;
+
+   td->startNs = GetTimeNs();
+   start = td->startNs;
+   now = start;
+   while (source.More(now)) {
+      VixDiskLibSectorType sector, numSectors;
+      VixError vixError;
+      uint64 issueNs;
+      bool read;
 
-    for (i = 0; i < appGlobals.numSectors; i++) {
-        VixError vixError = VixDiskLib_Read(disk.Handle(),
-                                            appGlobals.startSector + i,
-                                            1, buf);
-        CHECK_AND_THROW(vixError);
-        DumpBytes(buf, sizeof buf, 16);
-    }
+      source.Next(&read, &sector, &numSectors);
+      if (!read) {
+         data.Fill(buf.Get(), numSectors * VIXDISKLIB_SECTOR_SIZE);
+      }
+      rateLimiter.Acquire(numSectors);
+      issueNs = GetTimeNs();
+      if (read) {
+         vixError = VixDiskLib_Read(td->handle, sector, numSectors, buf.Get());
+      } else {
+         vixError = VixDiskLib_Write(td->handle, sector, numSectors, buf.Get());
+      }
+      now = GetTimeNs();
+      CHECK_AND_THROW(vixError);
+      (read ? reads : writes).Record(numSectors, now - issueNs);
+
+      if (source.EndWarmup(now)) {
+         reads.Reset();
+         writes.Reset();
+         td->reads.Reset();
+         td->writes.Reset();
+         td->startNs = now;
+         start = now;
+      } else if (reads.sectors + writes.sectors >= BUFS_PER_STAT) {
+         if (td->reportIntervals && !source.Warming()) {
+            PrintBenchStats(td->name, start, now, reads, writes);
+         }
+         td->reads.Merge(reads);
+         td->writes.Merge(writes);
+         reads.Reset();
+         writes.Reset();
+         start = now;
+      }
+   }
+   td->endNs = GetTimeNs();
+   td->reads.Merge(reads);
+   td->writes.Merge(writes);
 }
 
 
 /*
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  *
- * BitCount --
+ * DoAsyncBench --
  *
- *      Counts all the bits set in an int.
+ *      Issue the requests of a benchmark worker, keeping td->queueDepth
+ *      asynchronous requests in flight.
  *
  * Results:
- *      Number of bits set to 1.
+ *      None
  *
  * Side effects:
- *      None.
+ *      Fills in the timing and statistics of td.
  *
- *--------------------------------------------------------------------------
+ *----------------------------------------------------------------------
  */
 
-static int
-BitCount(int number)    // IN
+static void
+DoAsyncBench(BenchThreadData *td) // IN/OUT
 {
-    int bits = 0;
-    while (number) {
-        number = number & (number - 1);
-        bits++;
-    }
-    return bits;
+   // Keep every request buffer page aligned.
+   size_t bufSize = (MaxBlockSize(td) * VIXDISKLIB_SECTOR_SIZE +
+                     POOL_PAGE_SIZE - 1) & ~(size_t)(POOL_PAGE_SIZE - 1);
+   IoBuffer storage(BenchBufferSize(td));
+   vector<AsyncRequest> reqs(td->queueDepth);
+   BenchRequestSource source(td);
+   DataGenerator data(td->seed, td->compressPct, td->dedupPct);
+   AsyncBench bench;
+   uint64 issued;
+   uint32 i;
+   uint64 start, now;
+
+   bench.completed = 0;
+   bench.error = VIX_OK;
+   bench.measureFromNs = 0;
+   for (i = 0; i < td->queueDepth; i++) {
+      reqs[i].bench = &bench;
+      reqs[i].buf = storage.Get() + i * bufSize;
+      bench.idle.push_back(&reqs[i]);
+   }
+
+   td->startNs = GetTimeNs();
+   start = td->startNs;
+   now = start;
+   issued = 0;
+   bench.lock.Lock();
+   while (bench.completed < issued ||
+          (source.More(now) && bench.error == VIX_OK)) {
+      if (source.EndWarmup(now)) {
+         bench.reads.Reset();
+         bench.writes.Reset();
+         bench.measureFromNs = now;
+         td->reads.Reset();
+         td->writes.Reset();
+         td->startNs = now;
+         start = now;
+      }
+      if (source.More(now) && bench.error == VIX_OK && !bench.idle.empty()) {
+         AsyncRequest *req = bench.idle.back();
+         VixDiskLibSectorType sector;
+         VixError vixError;
+
+         bench.idle.pop_back();
+         issued++;
+         bench.lock.Unlock();
+         source.Next(&req->read, &sector, &req->numSectors);
+         if (!req->read) {
+            data.Fill(req->buf, req->numSectors * VIXDISKLIB_SECTOR_SIZE);
+         }
+         rateLimiter.Acquire(req->numSectors);
+         req->issueNs = GetTimeNs();
+         if (req->read) {
+            vixError = VixDiskLib_ReadAsync(td->handle, sector,
+                                            req->numSectors, req->buf,
+                                            AsyncBenchCallback, req);
+         } else {
+            vixError = VixDiskLib_WriteAsync(td->handle, sector,
+                                             req->numSectors, req->buf,
+                                             AsyncBenchCallback, req);
+         }
+         if (vixError != VIX_ASYNC) {
+            // Not queued, so the callback will not fire: complete it here.
+            AsyncBenchCallback(req, vixError);
+         }
+         now = req->issueNs;
+         bench.lock.Lock();
+         continue;
+      }
+
+      bench.cond.Wait(bench.lock);
+      now = GetTimeNs();
+      if (bench.reads.sectors + bench.writes.sectors >= BUFS_PER_STAT) {
+         BenchStats reads = bench.reads;
+         BenchStats writes = bench.writes;
+
+         bench.reads.Reset();
+         bench.writes.Reset();
+         bench.lock.Unlock();
+         if (td->reportIntervals && !source.Warming()) {
+            PrintBenchStats(td->name, start, now, reads, writes);
+         }
+         td->reads.Merge(reads);
+         td->writes.Merge(writes);
+         start = now;
+         bench.lock.Lock();
+      }
+   }
+   bench.lock.Unlock();
+   VixDiskLib_Wait(td->handle);
+   td->endNs = GetTimeNs();
+   td->reads.Merge(bench.reads);
+   td->writes.Merge(bench.writes);
+
+   if (VIX_FAILED(bench.error)) {
+      throw VixDiskLibErrWrapper(bench.error, __FILE__, __LINE__);
+   }
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * DumpBytes --
+ * BenchThread --
  *
- *      Displays an array of n bytes.
+ *      Worker thread of the read/write benchmarks.
  *
  * Results:
- *      None.
+ *      0 if succeeded, 1 if not.
  *
  * Side effects:
- *      None.
+ *      Sets appGlobals.success to false if fails.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-DumpBytes(const unsigned char *buf,     // IN
-          size_t n,                     // IN
-          int step)                     // IN
+static TaskResult TASK_CALL
+BenchThread(void *arg)
 {
-   size_t lines = n / step;
-   size_t i;
+   BenchThreadData *td = (BenchThreadData *)arg;
 
-   for (i = 0; i < lines; i++) {
-      int k, last;
-      printf("%04"FMTSZ"x : ", i * step);
-      for (k = 0; n != 0 && k < step; k++, n--) {
-         printf("%02x ", buf[i * step + k]);
-      }
-      printf("  ");
-      last = k;
-      while (k --) {
-         unsigned char c = buf[i * step + last - k - 1];
-         if (c < ' ' || c >= 127) {
-            c = '.';
-         }
-         printf("%c", c);
+   try {
+      if (td->queueDepth != 0) {
+         DoAsyncBench(td);
+      } else {
+         DoSyncBench(td);
       }
-      printf("\n");
+   } catch (const VixDiskLibErrWrapper& e) {
+      cout << "BenchThread (" << td->name << ") Error: " << e.ErrorCode()
+           << " " << e.Description() << "\n";
+      appGlobals.success = FALSE;
+      return TASK_FAIL;
    }
-   printf("\n");
+   return TASK_OK;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * CopyThread --
+ * RunBenchWorkers --
  *
- *       Copies a source disk to the given file.
+ *      Opens a disk handle for every benchmark worker and runs all of
+ *      them concurrently, one thread each.
  *
  * Results:
- *       0 if succeeded, 1 if not.
+ *      None.
  *
  * Side effects:
- *      Creates a new disk; sets appGlobals.success to false if fails
+ *      None.
  *
  *----------------------------------------------------------------------
  */
 
-#ifdef _WIN32
-#define TASK_OK 0
-#define TASK_FAIL 1
-
-static unsigned __stdcall
-#else
-#define TASK_OK ((void*)0)
-#define TASK_FAIL ((void*)1)
-
-static void *
-#endif
-CopyThread(void *arg)
+static void
+RunBenchWorkers(vector<BenchThreadData> &workers) // IN/OUT
 {
-   ThreadData *td = (ThreadData *)arg;
-
-    try {
-      VixDiskLibSectorType i;
-      VixError vixError;
-      uint8 buf[VIXDISKLIB_SECTOR_SIZE];
-
-      for (i = 0; i < td->numSectors; i ++) {
-         vixError = VixDiskLib_Read(td->srcHandle, i, 1, buf);
-         CHECK_AND_THROW(vixError);
-         vixError = VixDiskLib_Write(td->dstHandle, i, 1, buf);
-         CHECK_AND_THROW(vixError);
-      }
-
-    } catch (const VixDiskLibErrWrapper& e) {
-       cout << "CopyThread (" << td->dstDisk << ")Error: " << e.ErrorCode()
-            <<" " << e.Description();
-        appGlobals.success = FALSE;
-        return TASK_FAIL;
-    }
+   vector<DiskThread> threads(workers.size());
+   VixError vixError;
+   size_t i;
 
-    cout << "CopyThread to " << td->dstDisk << " succeeded.\n";
-    return TASK_OK;
+   for (i = 0; i < workers.size(); i++) {
+      threads[i].path = workers[i].diskPath.c_str();
+      threads[i].openFlags = workers[i].openFlags;
+      threads[i].bufSize = BenchBufferSize(&workers[i]);
+      threads[i].handle = &workers[i].handle;
+      threads[i].capacity = NULL;
+      threads[i].arg = &workers[i];
+   }
+   vixError = RunDiskThreads(threads, &BenchThread, NULL, NULL, NULL);
+   CHECK_AND_THROW(vixError);
+   if (!appGlobals.success) {
+      THROW_ERROR(VIX_E_FAIL);
+   }
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * PrepareThreadData --
+ * PrintWorkerTotals --
  *
- *      Open the source and destination disk for multi threaded copy.
+ *      Print the statistics of every benchmark worker, followed by the
+ *      aggregate over all workers.
  *
  * Results:
- *      Fills in ThreadData in td.
+ *      Aggregate throughput in MBytes/sec.
  *
  * Side effects:
- *      None.
+ *      If total is not NULL, it receives all requests of all workers,
+ *      and elapsedNs, if not NULL, the time from the first start to the
+ *      last end.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-PrepareThreadData(VixDiskLibConnection &dstConnection,
-                  ThreadData &td)
+static uint32
+PrintWorkerTotals(const vector<BenchThreadData> &workers, // IN
+                  BenchStats *total,                      // OUT: optional
+                  uint64 *elapsedNs)                      // OUT: optional
 {
-   VixError vixError;
-   VixDiskLibCreateParams createParams;
-   VixDiskLibInfo *info = NULL;
-   string prefixName,randomFilename;
-
-#ifdef _WIN32
-   prefixName = "c:\\test";
-#else
-   prefixName = "/tmp/test";
-#endif
-   GenerateRandomFilename(prefixName, randomFilename);
-   td.dstDisk = randomFilename;
-
-   vixError = VixDiskLib_Open(appGlobals.connection,
-                              appGlobals.diskPath,
-                              appGlobals.openFlags,
-                              &td.srcHandle);
-   CHECK_AND_THROW(vixError);
-
-   vixError = VixDiskLib_GetInfo(td.srcHandle, &info);
-   CHECK_AND_THROW(vixError);
-   td.numSectors = info->capacity;
-   VixDiskLib_FreeInfo(info);
+   BenchStats reads, writes;
+   uint64 start, end;
+   size_t i;
 
-   createParams.adapterType = VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC;
-   createParams.capacity = td.numSectors;
-   createParams.diskType = VIXDISKLIB_DISK_SPLIT_SPARSE;
-   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+   start = workers[0].startNs;
+   end = workers[0].endNs;
+   for (i = 0; i < workers.size(); i++) {
+      const BenchThreadData &td = workers[i];
 
-   vixError = VixDiskLib_Create(dstConnection, td.dstDisk.c_str(),
-                                &createParams, NULL, NULL);
-   CHECK_AND_THROW(vixError);
+      if (workers.size() > 1) {
+         PrintBenchStats(td.name, td.startNs, td.endNs, td.reads, td.writes);
+      }
+      start = std::min(start, td.startNs);
+      end = std::max(end, td.endNs);
+      reads.Merge(td.reads);
+      writes.Merge(td.writes);
+   }
+   if (total != NULL) {
+      total->Merge(reads);
+      total->Merge(writes);
+   }
+   if (elapsedNs != NULL) {
+      *elapsedNs = end - start;
+   }
 
-   vixError = VixDiskLib_Open(dstConnection, td.dstDisk.c_str(), 0,
-                              &td.dstHandle);
-   CHECK_AND_THROW(vixError);
+   std::ostringstream label;
+   if (workers.size() > 1) {
+      label << "Total (" << workers.size() << " threads): ";
+   }
+   return PrintBenchStats(label.str(), start, end, reads, writes);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * DoTestMultiThread --
+ * RunBenchThreads --
  *
- *      Starts a given number of threads, each of which will copy the
- *      source disk to a temp. file.
+ *      Split maxOps buffers starting at firstSector between
+ *      appGlobals.numThreads benchmark threads, or fewer if there are
+ *      not enough buffers to go around, either as contiguous
+ *      stripes or interleaved buffer by buffer (-interleave), each
+ *      thread with its own disk handle.
  *
  * Results:
- *      None.
+ *      Aggregate throughput in MBytes/sec.
  *
  * Side effects:
- *      None.
+ *      If total is not NULL, it receives the requests of all threads,
+ *      and elapsedNs, if not NULL, the duration of the run.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-DoTestMultiThread(void)
+static uint32
+RunBenchThreads(bool read,                        // IN
+                VixDiskLibSectorType firstSector, // IN
+                uint32 maxOps,                    // IN
+                uint32 queueDepth,                // IN
+                BenchStats *total,                // OUT: optional
+                uint64 *elapsedNs)                // OUT: optional
 {
-   VixDiskLibConnectParams cnxParams = { 0 };
-   VixDiskLibConnection dstConnection;
-   VixError vixError;
-   vector<ThreadData> threadData(appGlobals.numThreads);
-   int i;
-
-   vixError = VixDiskLib_Connect(&cnxParams, &dstConnection);
-   CHECK_AND_THROW(vixError);
-
-#ifdef _WIN32
-   vector<HANDLE> threads(appGlobals.numThreads);
-
-   for (i = 0; i < appGlobals.numThreads; i++) {
-      unsigned int threadId;
-
-      PrepareThreadData(dstConnection, threadData[i]);
-      threads[i] = (HANDLE)_beginthreadex(NULL, 0, &CopyThread,
-                                          (void*)&threadData[i], 0, &threadId);
-   }
-   WaitForMultipleObjects(appGlobals.numThreads, &threads[0], TRUE, INFINITE);
-#else
-   vector<pthread_t> threads(appGlobals.numThreads);
+   // Every thread gets at least one buffer.
+   unsigned numThreads = std::max(std::min((uint32)appGlobals.numThreads,
+                                           maxOps), (uint32)1);
+   vector<BenchThreadData> threadData(numThreads);
+   BlockSize size = { appGlobals.bufSize, 1 };
+   unsigned i;
+
+   for (i = 0; i < numThreads; i++) {
+      BenchThreadData &td = threadData[i];
+      std::ostringstream name;
+
+      if (numThreads > 1) {
+         name << "Thread " << i << ": ";
+      }
+      td.name = name.str();
+      td.diskPath = appGlobals.diskPath;
+      td.openFlags = appGlobals.openFlags;
+      td.readPct = read ? 100 : 0;
+      td.compressPct = appGlobals.compressPct;
+      td.dedupPct = appGlobals.dedupPct;
+      td.sizes.assign(1, size);
+      td.pattern = appGlobals.pattern;
+      td.seed = appGlobals.seed + i;
+      td.queueDepth = queueDepth;
+      td.durationNs = appGlobals.durationNs;
+      td.warmupNs = appGlobals.warmupNs;
+      td.reportIntervals = numThreads == 1;
+      td.endSector = firstSector + (VixDiskLibSectorType)maxOps * appGlobals.bufSize;
+      if (appGlobals.interleave) {
+         td.firstSector = firstSector +
+                          (VixDiskLibSectorType)i * appGlobals.bufSize;
+         td.stride = (VixDiskLibSectorType)numThreads * appGlobals.bufSize;
+         td.numOps = maxOps / numThreads + (i < maxOps % numThreads ? 1 : 0);
+      } else {
+         uint32 firstOp = (uint64)maxOps * i / numThreads;
 
-   for (i = 0; i < appGlobals.numThreads; i++) {
-      PrepareThreadData(dstConnection, threadData[i]);
-      pthread_create(&threads[i], NULL, &CopyThread, (void*)&threadData[i]);
-   }
-   for (i = 0; i < appGlobals.numThreads; i++) {
-      void *hlp;
-      pthread_join(threads[i], &hlp);
+         td.firstSector = firstSector +
+                          (VixDiskLibSectorType)firstOp * appGlobals.bufSize;
+         td.stride = appGlobals.bufSize;
+         td.numOps = (uint64)maxOps * (i + 1) / numThreads - firstOp;
+      }
    }
-#endif
 
-   for (i = 0; i < appGlobals.numThreads; i++) {
-      VixDiskLib_Close(threadData[i].srcHandle);
-      VixDiskLib_Close(threadData[i].dstHandle);
-      VixDiskLib_Unlink(dstConnection, threadData[i].dstDisk.c_str());
-   }
-   VixDiskLib_Disconnect(dstConnection);
-   if (!appGlobals.success) {
-      THROW_ERROR(VIX_E_FAIL);
-   }
+   RunBenchWorkers(threadData);
+   return PrintWorkerTotals(threadData, total, elapsedNs);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * CloneProgress --
+ * DoBlockSizeSweep --
  *
- *      Callback for the clone function.
+ *      Runs the read or write benchmark over the same numSectors sectors
+ *      region once per power-of-two multiple of appGlobals.sweepMin up
+ *      to appGlobals.sweepMax sectors. The knee is the first block size
+ *      after which doubling the size gains less than SWEEP_KNEE_GAIN.
  *
  * Results:
  *      None
  *
  * Side effects:
- *      None.
+ *      Changes appGlobals.bufSize.
  *
  *----------------------------------------------------------------------
  */
 
-static Bool
-CloneProgressFunc(void * /*progressData*/,      // IN
-                  int percentCompleted)         // IN
+static void
+DoBlockSizeSweep(bool read,                       // IN
+                 VixDiskLibSectorType numSectors) // IN
 {
-   cout << "Cloning : " << percentCompleted << "% Done" << "\r";
-   return TRUE;
+   uint32 queueDepth = appGlobals.qdMin;
+   vector<VixDiskLibSectorType> sizes;
+   vector<uint32> speeds;
+   vector<BenchStats> stats;
+   vector<uint64> elapsed;
+   size_t i, knee;
+
+   for (appGlobals.bufSize = appGlobals.sweepMin;
+        appGlobals.bufSize <= appGlobals.sweepMax &&
+        appGlobals.bufSize <= numSectors;
+        appGlobals.bufSize *= 2) {
+      uint32 maxOps = numSectors / appGlobals.bufSize;
+
+      printf("Block size %d bytes, %d buffers:\n",
+             (uint32)(appGlobals.bufSize * VIXDISKLIB_SECTOR_SIZE), maxOps);
+      sizes.push_back(appGlobals.bufSize);
+      stats.push_back(BenchStats());
+      elapsed.push_back(0);
+      speeds.push_back(RunBenchThreads(read, appGlobals.startSector, maxOps,
+                                       queueDepth, &stats.back(),
+                                       &elapsed.back()));
+   }
+   if (sizes.empty()) {
+      return;
+   }
+
+   for (knee = 0; knee + 1 < speeds.size(); knee++) {
+      if (speeds[knee + 1] < speeds[knee] * (1 + SWEEP_KNEE_GAIN)) {
+         break;
+      }
+   }
+
+   printf("\n%10s %12s %10s %12s %12s\n", "Block", "MBytes/sec", "IOPS",
+          "p50 usec", "p99 usec");
+   for (i = 0; i < sizes.size(); i++) {
+      printf("%10d %12d %10d %12.1f %12.1f%s\n",
+             (uint32)(sizes[i] * VIXDISKLIB_SECTOR_SIZE), speeds[i],
+             (uint32)(stats[i].ops / (std::max(elapsed[i], (uint64)1) / 1e9)),
+             stats[i].latency.Percentile(50) / 1000.0,
+             stats[i].latency.Percentile(99) / 1000.0,
+             i == knee ? "  <- knee" : "");
+   }
+   printf("Knee at %d sectors (%d bytes).\n", (uint32)sizes[knee],
+          (uint32)(sizes[knee] * VIXDISKLIB_SECTOR_SIZE));
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * DoClone --
+ * DoRWBench --
  *
- *      Clones a local disk (possibly to an ESX host).
+ *      Perform read/write benchmarks according to settings in
+ *      appGlobals. Note that a write benchmark will destroy the data
+ *      in the target disk.
  *
  * Results:
- *      None.
+ *      None
  *
  * Side effects:
  *      None.
@@ -1732,46 +9111,84 @@ CloneProgressFunc(void * /*progressData*/,      // IN
  */
 
 static void
-DoClone(void)
+DoRWBench(bool read) // IN
 {
-   VixDiskLibConnection srcConnection;
-   VixDiskLibConnectParams cnxParams = { 0 };
-   VixError vixError = VixDiskLib_Connect(&cnxParams, &srcConnection);
-   CHECK_AND_THROW(vixError);
+   size_t bufSize;
+   VixDiskLibInfo *info;
+   VixDiskLibSectorType numSectors;
+   VixError err;
+   uint32 maxOps, i;
 
-   /*
-    *  Note : These createParams are ignored for remote case
-    */
+   if (appGlobals.bufSize == 0) {
+      appGlobals.bufSize = DEFAULT_BUFSIZE;
+   }
+   bufSize = appGlobals.bufSize * VIXDISKLIB_SECTOR_SIZE;
 
-   VixDiskLibCreateParams createParams;
-   createParams.adapterType = appGlobals.adapterType;
-   createParams.capacity = appGlobals.mbSize * 2048;
-   createParams.diskType = VIXDISKLIB_DISK_MONOLITHIC_SPARSE;
-   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+   {
+      VixDisk disk(appGlobals.connection, appGlobals.diskPath,
+                   appGlobals.openFlags);
 
-   vixError = VixDiskLib_Clone(appGlobals.connection,
-                               appGlobals.diskPath,
-                               srcConnection,
-                               appGlobals.srcPath,
-                               &createParams,
-                               CloneProgressFunc,
-                               NULL,   // clientData
-                               TRUE);  // doOverWrite
-   VixDiskLib_Disconnect(srcConnection);
-   CHECK_AND_THROW(vixError);
-   cout << "\n Done" << "\n";
+      err = VixDiskLib_GetInfo(disk.Handle(), &info);
+      if (VIX_FAILED(err)) {
+         throw VixDiskLibErrWrapper(err, __FILE__, __LINE__);
+      }
+   }
+
+   if (appGlobals.startSector >= info->capacity) {
+      VixDiskLib_FreeInfo(info);
+      THROW_ERROR(VIX_E_INVALID_ARG);
+   }
+   numSectors = info->capacity - appGlobals.startSector;
+   if (appGlobals.countSpecified && appGlobals.numSectors < numSectors) {
+      numSectors = appGlobals.numSectors;
+   }
+   maxOps = numSectors / appGlobals.bufSize;
+   VixDiskLib_FreeInfo(info);
+
+   if (appGlobals.sweepMin != 0) {
+      DoBlockSizeSweep(read, numSectors);
+      return;
+   }
+
+   if (appGlobals.durationNs != 0) {
+      printf("Processing a region of %d buffers of %d bytes for %.1f "
+             "seconds.\n", maxOps, (uint32)bufSize,
+             appGlobals.durationNs / 1e9);
+   } else {
+      printf("Processing %d buffers of %d bytes.\n", maxOps, (uint32)bufSize);
+   }
+   if (maxOps == 0) {
+      return;
+   }
+
+   if (appGlobals.qdMax != 0) {
+      vector<uint32> speeds;
+      uint32 qd;
+
+      for (qd = appGlobals.qdMin; qd <= appGlobals.qdMax; qd *= 2) {
+         printf("Queue depth %d:\n", qd);
+         speeds.push_back(RunBenchThreads(read, appGlobals.startSector,
+                                          maxOps, qd, NULL, NULL));
+      }
+      for (qd = appGlobals.qdMin, i = 0; i < speeds.size(); qd *= 2, i++) {
+         printf("QD %3d: %d MBytes/sec\n", qd, speeds[i]);
+      }
+   } else {
+      RunBenchThreads(read, appGlobals.startSector, maxOps, 0, NULL, NULL);
+   }
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * PrintStat --
+ * ParseSectors --
  *
- *      Print performance statistics for read/write benchmarks.
+ *      Parses a size in sectors, or in bytes when followed by a k, m or
+ *      g suffix.
  *
  * Results:
- *      None
+ *      Number of sectors, 0 if invalid.
  *
  * Side effects:
  *      None.
@@ -1779,65 +9196,194 @@ DoClone(void)
  *----------------------------------------------------------------------
  */
 
-static void
-PrintStat(bool read,            // IN
-          struct timeval start, // IN
-          struct timeval end,   // IN
-          uint32 numSectors)    // IN
+static VixDiskLibSectorType
+ParseSectors(const char *str) // IN
 {
-   uint64 elapsed;
-   uint32 speed;
-
-   elapsed = ((uint64)end.tv_sec * 1000000 + end.tv_usec -
-              ((uint64)start.tv_sec * 1000000 + start.tv_usec)) / 1000;
-   if (elapsed == 0) {
-      elapsed = 1;
+   char *end;
+   uint64 value = strtoull(str, &end, 0);
+
+   switch (*end) {
+   case 'k': case 'K':
+      return value * 1024 / VIXDISKLIB_SECTOR_SIZE;
+   case 'm': case 'M':
+      return value * 1024 * 1024 / VIXDISKLIB_SECTOR_SIZE;
+   case 'g': case 'G':
+      return value * 1024 * 1024 * 1024 / VIXDISKLIB_SECTOR_SIZE;
+   case '\0':
+      return value;
+   default:
+      return 0;
    }
-   speed = (1000 * VIXDISKLIB_SECTOR_SIZE * (uint64)numSectors) / (1024 * 1024 * elapsed);
-   printf("%s %d MBytes in %d msec (%d MBytes/sec)\n", read ? "Read" : "Wrote",
-          (uint32)(numSectors /(2048)), (uint32)elapsed, speed);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * InitBuffer --
+ * ParseJobFile --
+ *
+ *      Reads the workloads of a -job file. Each workload starts with a
+ *      [name] line followed by key = value lines:
+ *
+ *         disk = path        target disk (default: diskPath argument)
+ *         mix = n            percentage of reads (default 100)
+ *         compress = pct     compressible part of writes (default: -compress)
+ *         dedup = pct        duplicate write blocks (default: -dedup)
+ *         bs = s[:w],...     request sizes in sectors, or bytes with a
+ *                            k/m/g suffix, with optional weights
+ *         pattern = p        access pattern, as for -pattern
+ *         seed = n           seed for random and zipf patterns
+ *         qd = n             outstanding asynchronous requests (0: sync)
+ *         duration = secs    run time (default: -duration, or one pass
+ *                            over the region)
+ *         warmup = secs      unreported warm-up time (default: -warmup)
+ *         start = n          first sector of the region
+ *         count = n          sectors in the region (default: rest of disk)
  *
- *      Fill an array of uint32 with random values, to defeat any
- *      attempts to compress it.
+ *      Blank lines and lines starting with # or ; are ignored.
  *
  * Results:
- *      None
+ *      true if the file was parsed successfully.
  *
  * Side effects:
- *      None.
+ *      Appends one entry per workload to jobs; region fields hold the
+ *      start and count settings until the disk sizes are known.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-InitBuffer(uint32 *buf,     // OUT
-           uint32 numElems) // IN
+static bool
+ParseJobFile(const char *path,               // IN
+             vector<BenchThreadData> &jobs)  // OUT
 {
-   int i;
+   FILE *file = fopen(path, "r");
+   char line[1024];
+   unsigned lineNo = 0;
+   BlockSize defaultSize = { DEFAULT_BUFSIZE, 1 };
+
+   if (file == NULL) {
+      printf("Error: Cannot open job file %s.\n", path);
+      return false;
+   }
+   while (fgets(line, sizeof line, file) != NULL) {
+      char *key = line, *val, *end;
+
+      lineNo++;
+      while (isspace((unsigned char)*key)) {
+         key++;
+      }
+      for (end = key + strlen(key); end > key && isspace((unsigned char)end[-1]);) {
+         *--end = '\0';
+      }
+      if (*key == '\0' || *key == '#' || *key == ';') {
+         continue;
+      }
+      if (*key == '[' && end[-1] == ']') {
+         BenchThreadData job;
+
+         end[-1] = '\0';
+         job.name = string("Job ") + (key + 1) + ": ";
+         job.diskPath = appGlobals.diskPath;
+         job.readPct = 100;
+         job.compressPct = appGlobals.compressPct;
+         job.dedupPct = appGlobals.dedupPct;
+         job.sizes.assign(1, defaultSize);
+         job.pattern.kind = PATTERN_SEQUENTIAL;
+         job.pattern.stride = 0;
+         job.pattern.zipfTheta = DEFAULT_ZIPF_THETA;
+         job.seed = appGlobals.seed + jobs.size();
+         job.queueDepth = 0;
+         job.firstSector = 0;
+         job.endSector = 0;
+         job.durationNs = appGlobals.durationNs;
+         job.warmupNs = appGlobals.warmupNs;
+         jobs.push_back(job);
+         continue;
+      }
 
-   srand(time(NULL));
+      val = strchr(key, '=');
+      if (val == NULL || jobs.empty()) {
+         printf("Error: %s:%d: expected [name] or key = value.\n", path, lineNo);
+         fclose(file);
+         return false;
+      }
+      for (end = val; end > key && isspace((unsigned char)end[-1]); end--) {
+      }
+      *end = '\0';
+      for (val++; isspace((unsigned char)*val); val++) {
+      }
 
-   for (i = 0; i < numElems; i++) {
-      buf[i] = (uint32)rand();
+      BenchThreadData &job = jobs.back();
+      bool valid = true;
+      if (!strcmp(key, "disk")) {
+         job.diskPath = val;
+      } else if (!strcmp(key, "mix")) {
+         job.readPct = strtoul(val, NULL, 0);
+         valid = job.readPct <= 100;
+      } else if (!strcmp(key, "compress")) {
+         job.compressPct = strtoul(val, NULL, 0);
+         valid = job.compressPct <= 100;
+      } else if (!strcmp(key, "dedup")) {
+         job.dedupPct = strtoul(val, NULL, 0);
+         valid = job.dedupPct <= 100;
+      } else if (!strcmp(key, "bs")) {
+         char *tok;
+
+         job.sizes.clear();
+         for (tok = strtok(val, ","); tok != NULL; tok = strtok(NULL, ",")) {
+            char *weight = strchr(tok, ':');
+            BlockSize size;
+
+            if (weight != NULL) {
+               *weight++ = '\0';
+            }
+            size.sectors = ParseSectors(tok);
+            size.weight = weight != NULL ? strtoul(weight, NULL, 0) : 1;
+            valid = valid && size.sectors != 0 && size.weight != 0;
+            job.sizes.push_back(size);
+         }
+         valid = valid && !job.sizes.empty();
+      } else if (!strcmp(key, "pattern")) {
+         valid = ParsePattern(val, &job.pattern);
+      } else if (!strcmp(key, "seed")) {
+         job.seed = strtoull(val, NULL, 0);
+      } else if (!strcmp(key, "qd")) {
+         job.queueDepth = strtoul(val, NULL, 0);
+         valid = job.queueDepth <= MAX_QUEUE_DEPTH;
+      } else if (!strcmp(key, "duration")) {
+         job.durationNs = (uint64)(strtod(val, NULL) * 1e9);
+      } else if (!strcmp(key, "warmup")) {
+         job.warmupNs = (uint64)(strtod(val, NULL) * 1e9);
+      } else if (!strcmp(key, "start")) {
+         job.firstSector = strtoull(val, NULL, 0);
+      } else if (!strcmp(key, "count")) {
+         job.endSector = strtoull(val, NULL, 0);
+      } else {
+         valid = false;
+      }
+      if (!valid) {
+         printf("Error: %s:%d: invalid setting '%s'.\n", path, lineNo, key);
+         fclose(file);
+         return false;
+      }
+   }
+   fclose(file);
+   if (jobs.empty()) {
+      printf("Error: %s does not describe any workload.\n", path);
+      return false;
    }
+   return true;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * DoRWBench --
+ * DoBenchJobs --
  *
- *      Perform read/write benchmarks according to settings in
- *      appGlobals. Note that a write benchmark will destroy the data
- *      in the target disk.
+ *      Runs the workloads described by the -job file concurrently, one
+ *      thread and disk handle each, over appGlobals.connection. Note
+ *      that workloads with writes destroy the data in their region.
  *
  * Results:
  *      None
@@ -1849,70 +9395,61 @@ InitBuffer(uint32 *buf,     // OUT
  */
 
 static void
-DoRWBench(bool read) // IN
+DoBenchJobs(void)
 {
-   VixDisk disk(appGlobals.connection, appGlobals.diskPath, appGlobals.openFlags);
-   size_t bufSize;
-   uint8 *buf;
-   VixDiskLibInfo *info;
-   VixError err;
-   uint32 maxOps, i;
-   uint32 bufUpdate;
-   struct timeval start, end, total;
-
-   if (appGlobals.bufSize == 0) {
-      appGlobals.bufSize = DEFAULT_BUFSIZE;
-   }
-   bufSize = appGlobals.bufSize * VIXDISKLIB_SECTOR_SIZE;
-
-   buf = new uint8[bufSize];
-   if (!read) {
-      InitBuffer((uint32*)buf, bufSize / sizeof(uint32));
-   }
+   vector<BenchThreadData> jobs;
+   size_t i;
 
-   err = VixDiskLib_GetInfo(disk.Handle(), &info);
-   if (VIX_FAILED(err)) {
-      delete [] buf;
-      throw VixDiskLibErrWrapper(err, __FILE__, __LINE__);
+   if (!ParseJobFile(appGlobals.jobFile, jobs)) {
+      THROW_ERROR(VIX_E_INVALID_ARG);
    }
 
-   maxOps = info->capacity / appGlobals.bufSize;
-   VixDiskLib_FreeInfo(info);
-
-   printf("Processing %d buffers of %d bytes.\n", maxOps, (uint32)bufSize);
-
-   gettimeofday(&total, NULL);
-   start = total;
-   bufUpdate = 0;
-   for (i = 0; i < maxOps; i++) {
+   for (i = 0; i < jobs.size(); i++) {
+      BenchThreadData &job = jobs[i];
+      VixDiskLibSectorType numSectors, slot;
+      VixDiskLibInfo *info;
       VixError vixError;
 
-      if (read) {
-         vixError = VixDiskLib_Read(disk.Handle(),
-                                    i * appGlobals.bufSize,
-                                    appGlobals.bufSize, buf);
-      } else {
-         vixError = VixDiskLib_Write(disk.Handle(),
-                                     i * appGlobals.bufSize,
-                                     appGlobals.bufSize, buf);
+      job.openFlags = appGlobals.openFlags & VIXDISKLIB_FLAG_OPEN_SINGLE_LINK;
+      if (job.readPct == 100) {
+         job.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+      }
+      {
+         VixDisk disk(appGlobals.connection, (char *)job.diskPath.c_str(),
+                      job.openFlags);
 
+         vixError = VixDiskLib_GetInfo(disk.Handle(), &info);
+         CHECK_AND_THROW(vixError);
       }
-      if (VIX_FAILED(vixError)) {
-         delete [] buf;
-         throw VixDiskLibErrWrapper(vixError, __FILE__, __LINE__);
+      numSectors = info->capacity > job.firstSector ?
+                   info->capacity - job.firstSector : 0;
+      VixDiskLib_FreeInfo(info);
+      if (job.endSector != 0 && job.endSector < numSectors) {
+         numSectors = job.endSector;
       }
 
-      bufUpdate += appGlobals.bufSize;
-      if (bufUpdate >= BUFS_PER_STAT) {
-         gettimeofday(&end, NULL);
-         PrintStat(read, start, end, bufUpdate);
-         start = end;
-         bufUpdate = 0;
+      // Requests start at multiples of the smallest request size.
+      slot = job.sizes[0].sectors;
+      for (size_t k = 1; k < job.sizes.size(); k++) {
+         slot = std::min(slot, job.sizes[k].sectors);
       }
+      if (numSectors < slot) {
+         printf("Error: %sregion is smaller than a request.\n",
+                job.name.c_str());
+         THROW_ERROR(VIX_E_INVALID_ARG);
+      }
+      job.stride = slot;
+      job.numOps = numSectors / slot;
+      job.endSector = job.firstSector + numSectors;
+      job.reportIntervals = jobs.size() == 1;
+      printf("%s%d%% reads, queue depth %d, %" FMT64 "u slots of %d bytes "
+             "on %s\n",
+             job.name.c_str(), job.readPct, job.queueDepth, job.numOps,
+             (uint32)(slot * VIXDISKLIB_SECTOR_SIZE), job.diskPath.c_str());
    }
-   gettimeofday(&end, NULL);
-   PrintStat(read, total, end, appGlobals.bufSize * maxOps);
-   delete [] buf;
+
+   RunBenchWorkers(jobs);
+   PrintWorkerTotals(jobs, NULL, NULL);
 }
 
 